@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/*/////////////////////////////////////////////////////////////////////
+//  Bitmap: .bmp files read without the OS
+///////////////////////////////////////////////////////////////////////
+//
+//    uncompressed 1, 4, 8, 24 & 32 bit bitmaps as 32 bit 0x00RRGGBB
+//    texels, bottom row first: the layout GetDIBits() gives for a
+//    bottom up 32 bit BI_RGB request
+//
+//    std::vector<uint32_t> texels;
+//    int width, height;
+//    if(D3::ReadBitmap("up.bmp", texels, width, height)) ...
+//*/
+
+namespace D3
+{
+    inline bool ReadBitmap(const char* file, std::vector<uint32_t>& texels, int& width, int& height)
+    {
+        std::vector<uint8_t> data;
+        if(FILE* f = fopen(file, "rb"))
+        {
+            uint8_t buffer[4096];
+            for (size_t read; (read = fread(buffer, 1, sizeof(buffer), f)) > 0; )
+            {
+                data.insert(data.end(), buffer, buffer + read);
+            }
+            fclose(f);
+        }
+
+        auto u16 = [&](size_t at) { return uint32_t(data[at] | data[at + 1] << 8); };
+        auto u32 = [&](size_t at) { return uint32_t(u16(at) | u16(at + 2) << 16); };
+
+        // BITMAPFILEHEADER (14 bytes) then a BITMAPINFOHEADER or larger
+        if((data.size() < 54) || (data[0] != 'B') || (data[1] != 'M'))
+            return false;
+        size_t  bits        = u32(10);
+        size_t  header      = u32(14);
+        int32_t w           = int32_t(u32(18));
+        int32_t h           = int32_t(u32(22));
+        int     bitCount    = int(u16(28));
+        uint32_t compression = u32(30);
+        size_t  colors      = u32(46);
+
+        bool topDown = h < 0;
+        if(topDown)
+            h = -h;
+        if((w <= 0) || (h <= 0) || (w > (1 << 14)) || (h > (1 << 14)))
+            return false;
+        if(!((compression == 0) || ((compression == 3) && (bitCount == 32))))  // BI_RGB, BI_BITFIELDS
+            return false;
+        if((bitCount != 1) && (bitCount != 4) && (bitCount != 8) && (bitCount != 24) && (bitCount != 32))
+            return false;
+
+        size_t palette = 14 + header;
+        if((bitCount <= 8) && !colors)
+            colors = size_t(1) << bitCount;
+        size_t stride = ((size_t(w) * bitCount + 31) / 32) * 4;
+        if((palette + colors * 4 > data.size()) || (bits + stride * h > data.size()))
+            return false;
+
+        width  = w;
+        height = h;
+        texels.resize(size_t(w) * h);
+        for (int y = 0; y < h; y++)
+        {
+            const uint8_t* row = &data[bits + stride * (topDown ? h - 1 - y : y)];
+            uint32_t* texel = &texels[size_t(y) * w];
+            for (int x = 0; x < w; x++)
+            {
+                switch(bitCount)
+                {
+                case 32:
+                case 24:
+                {
+                    const uint8_t* p = row + x * (bitCount / 8);
+                    texel[x] = uint32_t(p[0] | p[1] << 8 | p[2] << 16);
+                    break;
+                }
+                default:
+                {
+                    int perByte = 8 / bitCount;
+                    int shift   = 8 - bitCount * (x % perByte + 1);
+                    size_t index = (row[x / perByte] >> shift) & ((1 << bitCount) - 1);
+                    texel[x] = (index < colors) ? u32(palette + index * 4) & 0xffffff : 0;
+                    break;
+                }
+                }
+            }
+        }
+        return true;
+    }
+};  // namespace D3
@@ -1,10 +1,15 @@
 #pragma once
 
-#include <map>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <initializer_list>
 #include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "D3_simd.h"
 
 /*/////////////////////////////////////////////////////////////////////
 //  Supported operations
@@ -29,10 +34,26 @@
 //matrix operators:
 //    matrix = matrix * matrix;         // matrix *= matrix;
 //
-//mesh operators (poly collection) used as a model, world, or screen
+//mesh operators (poly collection) used as a model or screen
 //    mesh  = mesh + mesh;              // mesh   += mesh;
 //    mesh  = mesh * matrix;            // mesh   *= matrix;
-//    mesh.PerspectiveDivide();
+//    mesh.PerspectiveDivide();         // xyz /= w, w = 1/w
+//    mesh.Viewport(matrix);            // after PerspectiveDivide, matrix from Viewport()
+//    mesh.AddInstance(model, matrix);  // append model * matrix, unwelded
+//    mesh.AddProjected(model, matrix, view); // AddInstance, PerspectiveDivide & Viewport in one pass,
+//                                      // near plane clipped
+//    mesh.Cull(rect, backfaces);       // after Viewport, drops back faces & polygons outside rect
+//
+//    mesh.Bounds();                    // bounding sphere of the points added so far
+//    mesh.ResolveSurfaces(resolve);    // polygon.surface = resolve(polygon.id)
+//    mesh.ExportPolyPoly(polyPoly);    // after Viewport, the outlines
+//
+//polyPoly operators (screen polylines)
+//    polyPoly.Draw(pixels, rect, color); // clipped to rect, no OS drawing needed
+//
+//world operators (instance collection: model + matrix)
+//    world.Add(model, matrix);         // also places the model's bounding sphere
+//    world.SortFrontToBack(view, nearPlane, farPlane); // view from PointOfView()
 //
 ///////////////////////////////////////////////////////////////////////
 // manipulator matrices
@@ -50,9 +71,9 @@
 //    Matrix FieldOfView(float fovAngle, float aspectRatio, float nearPlane, float farPlane);
 //    Matrix Viewport(Rect& view, float minZ, float maxZ);
 //
-//    ScreenTrasnform(World& world, Rect& rect,
+//    ScreenTrasnform(const World& world, Rect& rect,
 //                      Point eye, Point target, Vector up,
-//                      float fovAngle, float nearPlane, float farPlane);
+//                      float fovAngle, float nearPlane, float farPlane, Screen& screen);
 //*/
 
 namespace D3
@@ -115,52 +136,48 @@ namespace D3
         float* operator [] (uint n) const { return (float*)_d[n]; }
     };
 
-    namespace
-    {
-        const float pi = 3.1415926535897932384626433832795f;
+    const float pi = 3.1415926535897932384626433832795f;
 
-        class Data4 // base of point & vector
+    class Data4 // base of point & vector
+    {
+    protected:
+        union
         {
-        protected:
-            union
-            {
-                struct { float _x, _y, _z, _w; };
-                struct { float _unused[4]; } _data;
-            };
+            struct { float _x, _y, _z, _w; };
+            struct { float _unused[4]; } _data;
+        };
 
-        public:
-            Data4() {}
-            Data4(const Data4& rhs) : _data(rhs._data) {}
-            Data4(float x, float y, float z, float w = 0) : _x(x), _y(y), _z(z), _w(w) {}
+    public:
+        Data4() {}
+        Data4(const Data4& rhs) : _data(rhs._data) {}
+        Data4(float x, float y, float z, float w = 0) : _x(x), _y(y), _z(z), _w(w) {}
 
-            Data4& operator = (const Data4& rhs)
-            {
-                _data = rhs._data;
-                return *this;
-            }
+        Data4& operator = (const Data4& rhs)
+        {
+            _data = rhs._data;
+            return *this;
+        }
 
-            void Multiply(const Matrix& rhs)
-            {
-                Data4 d = {
-                    _x * rhs[0][0] + _y * rhs[1][0] + _z * rhs[2][0] + _w * rhs[3][0],
-                    _x * rhs[0][1] + _y * rhs[1][1] + _z * rhs[2][1] + _w * rhs[3][1],
-                    _x * rhs[0][2] + _y * rhs[1][2] + _z * rhs[2][2] + _w * rhs[3][2],
-                    _x * rhs[0][3] + _y * rhs[1][3] + _z * rhs[2][3] + _w * rhs[3][3] };
-                _data = d._data;
-            }
+        void Multiply(const Matrix& rhs)
+        {
+            Data4 d = {
+                _x * rhs[0][0] + _y * rhs[1][0] + _z * rhs[2][0] + _w * rhs[3][0],
+                _x * rhs[0][1] + _y * rhs[1][1] + _z * rhs[2][1] + _w * rhs[3][1],
+                _x * rhs[0][2] + _y * rhs[1][2] + _z * rhs[2][2] + _w * rhs[3][2],
+                _x * rhs[0][3] + _y * rhs[1][3] + _z * rhs[2][3] + _w * rhs[3][3] };
+            _data = d._data;
+        }
 
-            float X() const { return _x; }
-            float Y() const { return _y; }
-            float Z() const { return _z; }
-            float W() const { return _w; }
-        };
-    }
+        float X() const { return _x; }
+        float Y() const { return _y; }
+        float Z() const { return _z; }
+        float W() const { return _w; }
+    };
 
     class Vector : public Data4
     {
     public:
         Vector() {}
-        Vector(const Vector& rhs) : Data4(rhs) {}
         Vector(float x, float y, float z) : Data4(x, y, z, 0) {}
 
         Vector CrossProduct(const Vector& rhs) const
@@ -180,23 +197,14 @@ namespace D3
 
     class Point : public Data4
     {
-        uint hash() const
-        {
-            std::hash<float> floatHash;
-            size_t ret = floatHash(_x);
-            ret ^= ret << 1;
-            ret += floatHash(_y);
-            ret ^= ret << 1;
-            ret += floatHash(_z);
-            return uint(ret);
-        }
-
     public:
         Point() {}
-        Point(const Point& rhs) : Data4(rhs) {}
         Point(float x, float y, float z, float w = 1) : Data4(x, y, z, w) {}
 
-        bool    operator < (const Point& rhs) const { return hash() < rhs.hash(); }
+        bool    operator == (const Point& rhs) const
+        {
+            return ((_x == rhs._x) && (_y == rhs._y) && (_z == rhs._z) && (_w == rhs._w));
+        }
 
         Point  Add(const Vector& rhs) const
         {
@@ -221,6 +229,12 @@ namespace D3
         float y = 0;
     };
 
+    struct Sphere
+    {
+        Point   center = { 0, 0, 0 };
+        float   radius = 0;
+    };
+
     struct Polygon
     {
         struct
@@ -239,50 +253,340 @@ namespace D3
             Point2  p1;
             Point2  p2;
         }       tripple2;
+        uint    surface;    // handle into the renderer's surface table, see ResolveSurfaces()
+    };
+
+    struct Rect     // pixels left..right-1 by top..bottom-1, laid out like a Win32 RECT
+    {
+        int left   = 0;
+        int top    = 0;
+        int right  = 0;
+        int bottom = 0;
+
+        bool operator ==(const Rect& rhs) const
+        {
+            return ((left   == rhs.left ) &&
+                    (top    == rhs.top  ) &&
+                    (right  == rhs.right) &&
+                    (bottom == rhs.bottom));
+        }
+        bool operator !=(const Rect& rhs) const { return !operator==(rhs); }
+        int Width()         const { return right - left; }
+        int Height()        const { return bottom - top; }
+        float AspectRatio() const { return float(Width()) / Height(); }
     };
 
     class PolyPoly
     {
     public:
-        using VPoints = std::vector<POINT>;
-        using VDWord = std::vector<DWORD>;
+        struct Pixel
+        {
+            int x;
+            int y;
+        };
+        using VPoints = std::vector<Pixel>;
+        using VCounts = std::vector<uint32_t>;
 
     private:
         VPoints _Points;
-        VDWord  _PolyPoints;
+        VCounts _PolyPoints;
+
+        // clipped to rect (Liang-Barsky) then stepped along the major axis, the end point excluded
+        static void DrawLine(Pixel p0, Pixel p1, uint32_t* pixels, const Rect& rect, uint32_t color)
+        {
+            float x0 = float(p0.x), y0 = float(p0.y);
+            float dx = float(p1.x - p0.x), dy = float(p1.y - p0.y);
+            float t0 = 0, t1 = 1;
+            const float p[4] = { -dx, dx, -dy, dy };
+            const float q[4] = { x0 - rect.left, rect.right - 1 - x0, y0 - rect.top, rect.bottom - 1 - y0 };
+            for (int i = 0; i < 4; i++)
+            {
+                if(p[i] == 0)
+                {
+                    if(q[i] < 0)
+                        return;
+                }
+                else
+                {
+                    float t = q[i] / p[i];
+                    if(p[i] < 0) t0 = std::max(t0, t);
+                    else         t1 = std::min(t1, t);
+                }
+            }
+            if(t0 > t1)
+                return;
+
+            int steps = std::max(abs(p1.x - p0.x), abs(p1.y - p0.y));
+            if(!steps)
+                return;
+            int first = int(ceil(t0 * steps));
+            int last  = std::min(int(floor(t1 * steps)), steps - 1);
+            const int width = rect.Width();
+            for (int i = first; i <= last; i++)
+            {
+                float t = float(i) / steps;
+                int x = int(floor(x0 + dx * t + 0.5f));
+                int y = int(floor(y0 + dy * t + 0.5f));
+                if((x >= rect.left) && (x < rect.right) && (y >= rect.top) && (y < rect.bottom))
+                    pixels[(x - rect.left) + (y - rect.top) * width] = color;
+            }
+        }
 
     public:
         PolyPoly() {}
+        void Clear()
+        {
+            _Points.clear();
+            _PolyPoints.clear();
+        }
+        void Add(const Pixel* points, size_t count)
+        {
+            _PolyPoints.push_back((uint32_t)count);
+            _Points.insert(_Points.end(), points, points + count);
+        }
         void Add(VPoints& points)
         {
-            _PolyPoints.push_back((DWORD)points.size());
-            _Points.insert(_Points.end(), points.begin(), points.end());
+            Add(points.data(), points.size());
+        }
+        // pixels is rect.Width() by rect.Height(), row major & top down
+        void Draw(uint32_t* pixels, const Rect& rect, uint32_t color) const
+        {
+            size_t first = 0;
+            for (uint32_t count : _PolyPoints)
+            {
+                for (size_t i = first + 1; i < first + count; i++)
+                {
+                    DrawLine(_Points[i - 1], _Points[i], pixels, rect, color);
+                }
+                first += count;
+            }
         }
-        void Draw(HDC hDC)
+    };
+
+    class Vertices // structure of arrays: aligned, padded x, y, z & w streams
+    {
+        using Stream = std::vector<float, Simd::Allocator<float>>;
+
+        Stream  _x;
+        Stream  _y;
+        Stream  _z;
+        Stream  _w;
+        size_t  _size = 0;
+
+    public:
+        size_t  Count() const   { return _size; }
+        size_t  Padded() const  { return Simd::Padded(_size); }
+        void    Clear()         { _size = 0; }
+
+        void Resize(size_t size)
         {
-            ::SelectObject(hDC, GetStockObject(WHITE_PEN));
-            ::PolyPolyline(hDC, _Points.data(), _PolyPoints.data(), (DWORD)_PolyPoints.size());
+            size_t padded = Simd::Padded(size);
+            if(_x.size() < padded)
+            {
+                _x.resize(padded, 0);
+                _y.resize(padded, 0);
+                _z.resize(padded, 0);
+                _w.resize(padded, 1);
+            }
+            _size = size;
+        }
+
+        void Reserve(size_t size)
+        {
+            size_t padded = Simd::Padded(size);
+            _x.reserve(padded);
+            _y.reserve(padded);
+            _z.reserve(padded);
+            _w.reserve(padded);
+        }
+
+        uint Add(const Point& point)
+        {
+            uint nDex = (uint)_size;
+            Resize(_size + 1);
+            Set(nDex, point);
+            return nDex;
+        }
+
+        void Set(size_t n, const Point& point)
+        {
+            _x[n] = point.X();
+            _y[n] = point.Y();
+            _z[n] = point.Z();
+            _w[n] = point.W();
+        }
+
+        Point operator[](size_t n) const
+            { return Point(_x[n], _y[n], _z[n], _w[n]); }
+
+        // start of a block of count points, aligned so kernels can run on it alone
+        size_t Append(size_t count)
+        {
+            size_t start = Padded();
+            Resize(start + count);
+            return start;
+        }
+
+        Simd::Streams Streams(size_t n = 0) const
+            { return { (float*)_x.data() + n, (float*)_y.data() + n, (float*)_z.data() + n, (float*)_w.data() + n }; }
+    };
+
+    class PointIndex // open addressing (linear probing) from exact coordinates to a Vertices index
+    {
+        std::vector<uint>   _slots;         // vertex index + 1, 0 is an empty slot
+        size_t              _indexed = 0;   // leading Vertices already in _slots
+
+        static uint Bits(float f)
+        {
+            uint bits;
+            f += 0.0f;              // -0 and +0 weld to the same vertex
+            memcpy(&bits, &f, sizeof(bits));
+            return bits;
+        }
+        static size_t Hash(const Point& point)
+        {
+            uint64_t h = Bits(point.X());
+            h = (h * 0x9E3779B97F4A7C15ull) ^ Bits(point.Y());
+            h = (h * 0x9E3779B97F4A7C15ull) ^ Bits(point.Z());
+            h = (h * 0x9E3779B97F4A7C15ull) ^ Bits(point.W());
+            h *= 0x9E3779B97F4A7C15ull;
+            return size_t(h ^ (h >> 32));
+        }
+        void Rehash(size_t slots, const Vertices& points)
+        {
+            _slots.assign(slots, 0);
+            size_t size = points.Count();
+            for (size_t i = 0; i < size; i++)
+            {
+                Find(points[i], points, uint(i));
+            }
+            _indexed = size;
+        }
+
+    public:
+        void Clear()
+        {
+            _slots.clear();
+            _indexed = 0;
+        }
+
+        // keeps the load factor under 1/2 for count points, (re)indexing points if cleared
+        void Reserve(size_t count, const Vertices& points)
+        {
+            if((count * 2 <= _slots.size()) && (_indexed == points.Count()))
+                return;
+
+            size_t slots = std::max<size_t>(_slots.size(), 16);
+            while (slots < count * 2) slots *= 2;
+            Rehash(slots, points);
+        }
+
+        // returns the index of the point equal to point, or adds nDex as its index
+        uint Find(const Point& point, const Vertices& points, uint nDex)
+        {
+            size_t mask = _slots.size() - 1;
+            for (size_t slot = Hash(point) & mask; ; slot = (slot + 1) & mask)
+            {
+                uint& entry = _slots[slot];
+                if(!entry)
+                {
+                    entry = nDex + 1;
+                    _indexed++;
+                    return nDex;
+                }
+                if(points[entry - 1] == point)
+                {
+                    return entry - 1;
+                }
+            }
         }
     };
 
     class Mesh
     {
-        using Points   = std::vector<Point>;
         using Polygons = std::vector<Polygon>;
-        using PointMap = std::map<Point, uint>;
 
-        PointMap            _mapPoints;
-        Points              _points;
+        PointIndex          _index;     // welds AddPoint() duplicates
+        Vertices            _points;
         Polygons            _polygons;
+        Point               _lo = {  FLT_MAX,  FLT_MAX,  FLT_MAX };  // bounds of the AddPoint() points
+        Point               _hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+        void AppendPolygons(const Mesh& model, uint start) // unwelded, points already at start
+        {
+            for (const Polygon& polygon : model._polygons)
+            {
+                Polygon poly = polygon;
+                poly.tripple3.i0 += start;
+                poly.tripple3.i1 += start;
+                poly.tripple3.i2 += start;
+                _polygons.push_back(poly);
+            }
+        }
+
+        // the clip space path of AddProjected(): polygons are clipped against the near plane
+        // (z >= 0), which keeps w >= near, so the divide can't blow up or mirror a vertex;
+        // x & y are left to the rasterizer's guard band and bounding box
+        void AppendClipped(const Mesh& model, const Matrix& matrix, const Matrix& view, uint start)
+        {
+            Simd::Transform(matrix[0], model._points.Streams(), _points.Streams(start), model._points.Padded());
+            for (const Polygon& polygon : model._polygons)
+            {
+                uint index[3] = { polygon.tripple3.i0 + start, polygon.tripple3.i1 + start, polygon.tripple3.i2 + start };
+                const Point2* texel[3] = { &polygon.tripple2.p0, &polygon.tripple2.p1, &polygon.tripple2.p2 };
+                bool in[3];
+                for (int k = 0; k < 3; k++)
+                {
+                    in[k] = _points[index[k]].Z() >= 0;
+                }
+
+                // a triangle clipped by one plane keeps 0, 3 or 4 points
+                uint   clipped[4];
+                Point2 texels[4];
+                int    count = 0;
+                for (int k = 0; k < 3; k++)
+                {
+                    int j = (k + 1) % 3;
+                    if(in[k])
+                    {
+                        clipped[count] = index[k];
+                        texels[count++] = *texel[k];
+                    }
+                    if(in[k] != in[j])
+                    {
+                        Point a = _points[index[k]];
+                        Point b = _points[index[j]];
+                        float t = a.Z() / (a.Z() - b.Z());
+                        clipped[count] = _points.Add(Point(a.X() + (b.X() - a.X()) * t, a.Y() + (b.Y() - a.Y()) * t,
+                                                           a.Z() + (b.Z() - a.Z()) * t, a.W() + (b.W() - a.W()) * t));
+                        texels[count++] = { texel[k]->x + (texel[j]->x - texel[k]->x) * t,
+                                            texel[k]->y + (texel[j]->y - texel[k]->y) * t };
+                    }
+                }
+
+                Polygon poly = polygon;
+                for (int k = 2; k < count; k++)     // fan, keeps the winding
+                {
+                    poly.tripple3.i0 = clipped[0];
+                    poly.tripple3.i1 = clipped[k - 1];
+                    poly.tripple3.i2 = clipped[k];
+                    poly.tripple2.p0 = texels[0];
+                    poly.tripple2.p1 = texels[k - 1];
+                    poly.tripple2.p2 = texels[k];
+                    _polygons.push_back(poly);
+                }
+            }
+
+            size_t padded = Simd::Padded(_points.Count() - start);
+            Simd::PerspectiveDivide(_points.Streams(start), padded);
+            Simd::Viewport(_points.Streams(start), padded, view[0]);
+        }
 
     public:
         Mesh() {}
         Mesh(const std::initializer_list<Polygon> polygons)
         {
-            for (auto& polygon : polygons)
-            {
-                AddPolygon(polygon);
-            }
+            AddPolygons(polygons.begin(), polygons.size());
         }
         Mesh(const Mesh& rhs)
         {
@@ -290,15 +594,13 @@ namespace D3
         }
         Mesh operator = (const Mesh& rhs)
         {
-            _mapPoints.clear();
-            _points.clear();
-            _polygons.clear();
-
+            Clear();
             return AddTo(rhs);
         }
         Mesh& AddTo(const Mesh& rhs)
         {
             size_t size = rhs.Count();
+            Reserve(size);
             for (size_t i = 0; i < size; i++)
             {
                 AddPolygon(rhs[i]);
@@ -306,9 +608,27 @@ namespace D3
             return *this;
         }
 
+        // pre-sizes the point index, vertices and polygons for count more polygons
+        void Reserve(size_t count)
+        {
+            size_t points = _points.Count() + count * 3;
+            _index.Reserve(points, _points);
+            _points.Reserve(points);
+            _polygons.reserve(_polygons.size() + count);
+        }
+
         int Count() const
             { return int(_polygons.size()); }
 
+        void Clear() // keeps the allocations for reuse
+        {
+            _index.Clear();
+            _points.Clear();
+            _polygons.clear();
+            _lo = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+            _hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        }
+
         void AddPolygon(const Polygon polygon)
         {
             Polygon poly = polygon;
@@ -318,22 +638,72 @@ namespace D3
             _polygons.push_back(poly);
         }
 
-        uint AddPoint(const Point& point)
+        void AddPolygons(const Polygon* polygons, size_t count)
         {
-            auto it = _mapPoints.find(point);
-            uint nDex = (uint)_points.size();
-            if(it == _mapPoints.end())
+            Reserve(count);
+            for (size_t i = 0; i < count; i++)
             {
-                _points.push_back(point);
-                _mapPoints[point] = nDex;
+                AddPolygon(polygons[i]);
             }
-            else
+        }
+        void AddPolygons(const std::vector<Polygon>& polygons)
+            { AddPolygons(polygons.data(), polygons.size()); }
+
+        uint AddPoint(const Point& point)
+        {
+            size_t size = _points.Count();
+            _index.Reserve(size + 1, _points);
+
+            uint nDex = _index.Find(point, _points, (uint)size);
+            if(nDex == size)
             {
-                nDex = it->second;
+                _points.Add(point);
+                _lo = { std::min(_lo.X(), point.X()), std::min(_lo.Y(), point.Y()), std::min(_lo.Z(), point.Z()) };
+                _hi = { std::max(_hi.X(), point.X()), std::max(_hi.Y(), point.Y()), std::max(_hi.Z(), point.Z()) };
             }
             return nDex;
         }
 
+        // sets every polygon's surface handle from its id, once when the model is built
+        template<typename Resolve>
+        void ResolveSurfaces(Resolve resolve)
+        {
+            for (Polygon& polygon : _polygons)
+            {
+                polygon.surface = resolve(polygon.id);
+            }
+        }
+
+        // the sphere around the bounding box of the points added by AddPoint(), models are built that way
+        Sphere Bounds() const
+        {
+            Sphere sphere;
+            if(_lo.X() > _hi.X())
+                return sphere;
+            float dx = (_hi.X() - _lo.X()) / 2;
+            float dy = (_hi.Y() - _lo.Y()) / 2;
+            float dz = (_hi.Z() - _lo.Z()) / 2;
+            sphere.center = { _lo.X() + dx, _lo.Y() + dy, _lo.Z() + dz };
+            sphere.radius = sqrt(dx * dx + dy * dy + dz * dz);
+            return sphere;
+        }
+
+        // the z the polygons' points span, clamped at 0; lo > hi when there are none
+        void DepthRange(float& lo, float& hi) const
+        {
+            lo = FLT_MAX;
+            hi = 0;
+            for (const Polygon& polygon : _polygons)
+            {
+                for (uint i : { polygon.tripple3.i0, polygon.tripple3.i1, polygon.tripple3.i2 })
+                {
+                    float z = std::max(_points[i].Z(), 0.0f);
+                    lo = std::min(lo, z);
+                    hi = std::max(hi, z);
+                }
+            }
+        }
+
         Polygon operator[](size_t position) const
         {
             Polygon poly = _polygons[position];
@@ -345,20 +715,79 @@ namespace D3
 
         Mesh& Multiply(const Matrix& matrix)
         {
-            _mapPoints.clear();
-            for (auto& point : _points)
+            _index.Clear();
+            Simd::Streams streams = _points.Streams();
+            Simd::Transform(matrix[0], streams, streams, _points.Padded());
+            return *this;
+        }
+
+        // appends model * matrix without welding, instances never share vertices
+        void AddInstance(const Mesh& model, const Matrix& matrix)
+        {
+            _index.Clear();
+            uint start = (uint)_points.Append(model._points.Count());
+            Simd::Transform(matrix[0], model._points.Streams(), _points.Streams(start), model._points.Padded());
+            AppendPolygons(model, start);
+        }
+
+        // AddInstance, PerspectiveDivide & Viewport(view) fused in one pass over the model;
+        // an instance reaching past the near plane is redone in clip space and clipped
+        void AddProjected(const Mesh& model, const Matrix& matrix, const Matrix& view)
+        {
+            _index.Clear();
+            size_t count = model._points.Count();
+            uint start = (uint)_points.Append(count);
+            Simd::Streams s = _points.Streams(start);
+            Simd::Project(matrix[0], view[0], model._points.Streams(), s, model._points.Padded());
+            for (size_t i = 0; i < count; i++)
             {
-                point.Multiply(matrix);
+                if(!((s.w[i] > 0) && (s.z[i] >= view[3][2])))  // 1/w & the viewport's min z, also catches NaN
+                {
+                    AppendClipped(model, matrix, view, start);
+                    return;
+                }
             }
-            return *this;
+            AppendPolygons(model, start);
         }
 
         void PerspectiveDivide()
         {
-            for (Point& point : _points)
+            _index.Clear();
+            Simd::PerspectiveDivide(_points.Streams(), _points.Padded());
+        }
+
+        void Viewport(const Matrix& view) // view from D3::Viewport(), applied after PerspectiveDivide()
+        {
+            _index.Clear();
+            Simd::Viewport(_points.Streams(), _points.Padded(), view[0]);
+        }
+
+        // after Viewport(): drops the polygons whose bounds miss view and, for closed models,
+        // the ones facing away (models wind counter clockwise seen from outside); keeps the
+        // points, polygons crossing w = 0 are left to the rasterizer; returns the count dropped
+        int Cull(const Rect& view, bool backfaces)
+        {
+            Simd::Streams s = _points.Streams();
+            size_t kept = 0;
+            for (const Polygon& polygon : _polygons)
             {
-                point.PerspectiveDivide();
+                uint i0 = polygon.tripple3.i0, i1 = polygon.tripple3.i1, i2 = polygon.tripple3.i2;
+                bool keep = !((s.w[i0] > 0) && (s.w[i1] > 0) && (s.w[i2] > 0));
+                if(!keep)
+                {
+                    float x0 = s.x[i0], x1 = s.x[i1], x2 = s.x[i2];
+                    float y0 = s.y[i0], y1 = s.y[i1], y2 = s.y[i2];
+                    keep = (std::max(std::max(x0, x1), x2) >= view.left) && (std::min(std::min(x0, x1), x2) <= view.right) &&
+                           (std::max(std::max(y0, y1), y2) >= view.top)  && (std::min(std::min(y0, y1), y2) <= view.bottom);
+                    if(keep && backfaces)
+                        keep = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0) < 0;
+                }
+                if(keep)
+                    _polygons[kept++] = polygon;
             }
+            int culled = int(_polygons.size() - kept);
+            _polygons.resize(kept);
+            return culled;
         }
 
         void ExportPolyPoly(PolyPoly& polyPoly)
@@ -367,38 +796,104 @@ namespace D3
             for (size_t i = 0; i < size; i++)
             {
                 Polygon polygon = operator[](i);
-                PolyPoly::VPoints points;
-                points.reserve(3);
-                points.push_back({ int(polygon.tripple3.p0.X()), int(polygon.tripple3.p0.Y()) });
-                points.push_back({ int(polygon.tripple3.p1.X()), int(polygon.tripple3.p1.Y()) });
-                points.push_back({ int(polygon.tripple3.p2.X()), int(polygon.tripple3.p2.Y()) });
-                points.push_back({ int(polygon.tripple3.p0.X()), int(polygon.tripple3.p0.Y()) });
-                polyPoly.Add(points);
+                PolyPoly::Pixel points[] = {
+                    { int(polygon.tripple3.p0.X()), int(polygon.tripple3.p0.Y()) },
+                    { int(polygon.tripple3.p1.X()), int(polygon.tripple3.p1.Y()) },
+                    { int(polygon.tripple3.p2.X()), int(polygon.tripple3.p2.Y()) },
+                    { int(polygon.tripple3.p0.X()), int(polygon.tripple3.p0.Y()) } };
+                polyPoly.Add(points, 4);
             }
         }
     };
 
     using Model = Mesh;
-    using World = Mesh;
     using Screen = Mesh;
     using PModel = std::shared_ptr<Model>;
 
-    class Rect : public RECT
+    class World // instance collection: each model is placed by its own matrix, not copied
     {
     public:
-        Rect() : RECT{ 0 } {}
-        Rect(const RECT& rhs) { *this == rhs; }
-        bool operator ==(const RECT& rhs) const
+        struct Instance
         {
-            return ((left   == rhs.left ) &&
-                    (top    == rhs.top  ) &&
-                    (right  == rhs.right) &&
-                    (bottom == rhs.bottom));
+            const Model*    model;  // models outlive the worlds built from them
+            Matrix          matrix;
+            Sphere          bounds; // world space
+        };
+
+    private:
+        using Instances = std::vector<Instance>;
+
+        Instances               _instances;
+        Instances               _sorted;    // SortFrontToBack() scratch, kept for reuse
+        std::vector<uint64_t>   _keys;
+        std::vector<uint64_t>   _keysSorted;
+
+    public:
+        void Clear()
+            { _instances.clear(); }
+
+        void Add(const Model& model, const Matrix& matrix)
+        {
+            Sphere bounds = model.Bounds();
+            bounds.center.Multiply(matrix);
+            float scale = 0;
+            for (uint i = 0; i < 3; i++)
+            {
+                scale = std::max(scale, matrix[i][0] * matrix[i][0] + matrix[i][1] * matrix[i][1] + matrix[i][2] * matrix[i][2]);
+            }
+            bounds.radius *= sqrt(scale);
+            _instances.push_back({ &model, matrix, bounds });
         }
-        bool operator !=(const RECT& rhs) const { return !operator==(rhs); }
-        int Width()         const { return right - left; }
-        int Height()        const { return bottom - top; }
-        float AspectRatio() const { return float(Width()) / Height(); }
+
+        // stable radix sort on the view depth of each instance's nearest bounding point,
+        // quantised to 16 bits between the planes; view looks down -z, as from PointOfView()
+        void SortFrontToBack(const Matrix& view, float nearPlane, float farPlane)
+        {
+            size_t size = _instances.size();
+            _keys.resize(size);
+            _keysSorted.resize(size);
+            _sorted.resize(size);
+
+            float scale = 0xffff / (farPlane - nearPlane);
+            for (size_t i = 0; i < size; i++)
+            {
+                Point center = _instances[i].bounds.center;
+                center.Multiply(view);
+                float depth = (-center.Z() - _instances[i].bounds.radius - nearPlane) * scale;
+                uint64_t key = !(depth > 0) ? 0 : (depth < 0xffff) ? uint64_t(depth) : 0xffff;
+                _keys[i] = (key << 32) | i;
+            }
+
+            for (int shift = 32; shift < 48; shift += 8)
+            {
+                size_t start[257] = {};
+                for (uint64_t key : _keys)
+                {
+                    start[((key >> shift) & 0xff) + 1]++;
+                }
+                for (int digit = 0; digit < 256; digit++)
+                {
+                    start[digit + 1] += start[digit];
+                }
+                for (uint64_t key : _keys)
+                {
+                    _keysSorted[start[(key >> shift) & 0xff]++] = key;
+                }
+                _keys.swap(_keysSorted);
+            }
+
+            for (size_t i = 0; i < size; i++)
+            {
+                _sorted[i] = _instances[uint32_t(_keys[i])];
+            }
+            _instances.swap(_sorted);
+        }
+
+        int Count() const
+            { return int(_instances.size()); }
+
+        const Instance& operator[](size_t position) const
+            { return _instances[position]; }
     };
 
     // Matrix Operators
@@ -535,17 +1030,29 @@ namespace D3
                 { 0,  0, maxZ, 0, },
                 { x,  y, minZ, 1, } };
     }
-    inline Screen ScreenTrasnform(World& world, Rect& rect,
+    inline void ScreenTrasnform(const World& world, Rect& rect,
                                     Point eye,Point target, Vector up,
-                                    float fovAngle, float nearPlane, float farPlane)
+                                    float fovAngle, float nearPlane, float farPlane, Screen& screen)
     {
         Matrix pov = PointOfView(eye, target, up);
         Matrix fov = FieldOfView(fovAngle, rect.AspectRatio(), nearPlane, farPlane);
         Matrix view = Viewport(rect, 0, 100);
+        Matrix project = pov * fov;
 
-        Screen screen = world * (pov * fov * view);
-        screen.PerspectiveDivide();
-
+        screen.Clear();
+        size_t size = world.Count();
+        for (size_t i = 0; i < size; i++)
+        {
+            const World::Instance& instance = world[i];
+            screen.AddProjected(*instance.model, instance.matrix * project, view);
+        }
+    }
+    inline Screen ScreenTrasnform(const World& world, Rect& rect,
+                                    Point eye,Point target, Vector up,
+                                    float fovAngle, float nearPlane, float farPlane)
+    {
+        Screen screen;
+        ScreenTrasnform(world, rect, eye, target, up, fovAngle, nearPlane, farPlane, screen);
         return screen;
     }
 
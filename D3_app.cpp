@@ -1,16 +1,51 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <windowsx.h>
+#include <stdio.h>
 #include <memory>
 #include "D3_app.h"
 #include "D3.h"
 #include "Render.h"
+#include "DibFramebuffer.h"
+#include "RenderThread.h"
 
 #include <Mmsystem.h>
 #pragma comment(lib, "winmm")
 
 HINSTANCE hInst;
 
+// count the renderer's heap allocations (render thread, workers & geometry stage) so the stats
+// can show the steady state frame makes none; the UI thread's own don't belong to a frame
+static thread_local bool s_uiThread = false;
+void* operator new(size_t size)
+{
+    if(!s_uiThread)
+        D3::Simd::Allocations()++;
+    if(void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
 INT_PTR CALLBACK About(HWND hDlg, uint message, WPARAM wParam, LPARAM)
 {
     switch(message)
@@ -24,12 +59,14 @@ INT_PTR CALLBACK About(HWND hDlg, uint message, WPARAM wParam, LPARAM)
     return false;
 }
 
-static const Options::Mode   Modes[] = { Options::Wireframe, Options::DepthBuffer, Options::Image, };
+static const Options::Mode   Modes[] = { Options::Wireframe, Options::DepthBuffer, Options::Image, Options::Overdraw, };
 static const Options::Model Models[] = { Options::Up, Options::Frankie, Options::Mixed, Options::Halfempty, Options::Earth, Options::Grid, };
 static const Options::Delay Delays[] = { Options::fast, Options::medium, Options::slow, };
 static const float          Scales[] = { 5, 10, 15, 20, 25, };
 static const float         Offsets[] = { 5, 10, 15, 20, 25, };
-static const char*        surfaces[] = { "Up.bmp", "Frankie.bmp", "Earth.bmp", "Grid.bmp", };
+static const uint          Threads[] = { 0, 1, 2, 4, 8, 16, };
+static const Options::DepthFormat Depths[] = { Options::Fixed32, Options::Unorm16, Options::Float32, };
+static const char*        surfaces[] = { "up.bmp", "frankie.bmp", "earth.bmp", "grid.bmp", };
 
 static Options             m_options = { surfaces, Scales[ID_SCALE_DEFAULT - ID_SCALE], Offsets[ID_OFFSET_DEFAULT - ID_OFFSET] };
 
@@ -38,10 +75,16 @@ static uint m_nMode  = ID_MODE_DEFAULT;
 static uint m_nModel = ID_MODEL_DEFAULT;
 static uint m_nScale = ID_SCALE_DEFAULT;
 static uint m_nOffset= ID_OFFSET_DEFAULT;
+static uint m_nThreads = ID_THREADS_DEFAULT;
+static uint m_nDepth = ID_DEPTH_DEFAULT;
 
 static IRender* _pRender = nullptr;
+static DibFramebuffer _frames[RenderThread::Buffers];
+static RenderThread* _pThread = nullptr;
 static D3::Point _eye = { 0, 0, 100, 0 };
 
+static const UINT_PTR AnimateTimer = 1;     // the tracking one is WM_TIMER
+
 template<typename T1, typename T2>
 void OnRange(HWND hWnd, uint nID, uint& nSetting, uint idBase, T1& option, T2 values[])
 {
@@ -61,15 +104,127 @@ void OnToggle(HWND hWnd, uint id, bool& option)
     InvalidateRect(hWnd, nullptr, false);
 }
 
+// the render thread draws with the latest options, eye & window size
+void Submit(HWND hWnd)
+{
+    if(!_pThread)
+        return;
+    RECT rect;
+    GetClientRect(hWnd, &rect);
+    _pThread->Submit(m_options, _eye, rect.right - rect.left, rect.bottom - rect.top);
+}
+
+// the animation steps at the speed picked, unless paused
+void Animate(HWND hWnd)
+{
+    if(m_options.pause) { KillTimer(hWnd, AnimateTimer); }
+    else                { SetTimer(hWnd, AnimateTimer, m_options.delay, nullptr); }
+}
+
+// returns the height of the text drawn
+int DrawStats(HDC hdc, COLORREF color, const RenderThread::Frame& frame)
+{
+    int offset = 0;
+    if(frame.options.stats)
+    {
+        const Stats& stats = frame.stats;
+        const D3::Point& eye = frame.eye;
+        char sz[64] = {};
+        SetTextColor(hdc, color);
+        SetBkColor(hdc, 0xffffff - color);
+        if(!frame.options.pause)
+        {
+            double delta = stats.seconds * 1000 + 1;
+            int len = sprintf(sz, "Frames/S = %f", double(stats.frames) * 1000 / delta);
+            TextOut(hdc, 0, offset, sz, len);
+            offset += 20;
+            if(frame.options.mode != Options::Wireframe)
+            {
+                len = sprintf(sz, "MPixels/S = %f", double(stats.pixels) / 1000 / delta);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+                len = sprintf(sz, "Culled = %u of %u", stats.culled, stats.culled + stats.triangles);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+                len = sprintf(sz, "Rasterized = %u of %u", stats.rasterized, stats.triangles);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+                double frames = stats.frames ? double(stats.frames) : 1;
+                len = sprintf(sz, "Tested KPixels/F = %.1f", double(stats.pixels) / 1000 / frames);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+                len = sprintf(sz, "Texels K/F = %.1f", double(stats.texels) / 1000 / frames);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+                len = sprintf(sz, "Rejected = %.1f%%", stats.pixels ? double(stats.pixels - stats.written) * 100 / stats.pixels : 0.0);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+                len = sprintf(sz, "Cleared KB/F = %u", uint(stats.cleared / 1024));
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+            }
+            len = sprintf(sz, "Allocs/F = %u", uint(stats.allocs));
+            TextOut(hdc, 0, offset, sz, len);
+            offset += 20;
+            len = sprintf(sz, "pov: x:%-2d y:%-2d z:%-2d r:%-2d", (int)eye.X(), (int)eye.Y(), (int)eye.Z(), (int)eye.W());
+            TextOut(hdc, 0, offset, sz, len);
+            offset += 20;
+
+            // the stages that ran in the last frames, p50 / p95 / p99
+            for (int stage = 0; stage < D3::Profile::Stages; stage++)
+            {
+                const double* ms = frame.ms[stage];
+                if(!ms[2])
+                    continue;
+                len = sprintf(sz, "%-9s ms = %.2f / %.2f / %.2f", D3::Profile::StageName(D3::Profile::Stage(stage)), ms[0], ms[1], ms[2]);
+                TextOut(hdc, 0, offset, sz, len);
+                offset += 20;
+            }
+        }
+        else
+        {
+            TextOutA(hdc, 0, 0, "Paused", 6);
+            offset += 20;
+        }
+    }
+    return offset;
+}
+
+// the render thread draws into the window sized DIB sections, the newest finished one gets
+// the stats over the picture and is presented straight from its plane
+void Paint(HWND hWnd, HDC hdcScreen)
+{
+    Submit(hWnd);
+    const RenderThread::Frame* frame = _pThread->Acquire();
+    if(!frame)
+        return;
+
+    int64_t start = _pRender->Profiler().Now();
+    DibFramebuffer* dib = static_cast<DibFramebuffer*>(frame->frame);
+    HDC hdc = dib->DC(frame->plane);
+    bool depth = (frame->plane == Framebuffer::Depth);
+    D3::Rect text;
+    text.right  = int(dib->Width());
+    text.bottom = DrawStats(hdc, depth ? RGB(0, 0, 0) : RGB(255, 255, 255), *frame);
+    BitBlt(hdcScreen, 0, 0, dib->Width(), dib->Height(), hdc, 0, 0, SRCCOPY);
+    GdiFlush();
+    _pThread->Presented(depth ? D3::Rect() : text, start, _pRender->Profiler().Now());
+}
+
 
 LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
 {
     switch(message)
     {
     case WM_CREATE:
-        _pRender = IRender::Create(hWnd);
+    {
+        _pRender = IRender::Create(m_options);
+        Framebuffer* frames[RenderThread::Buffers] = { &_frames[0], &_frames[1], &_frames[2] };
+        _pThread = new RenderThread(*_pRender, frames, [hWnd] { InvalidateRect(hWnd, nullptr, false); });
+        Animate(hWnd);
         ShowWindow(hWnd, SW_SHOW);
         break;
+    }
 
     case WM_COMMAND:
     {
@@ -88,6 +243,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
         case ID_MODE_WIREFRAME:
         case ID_MODE_DEPTH_BUFFER:
         case ID_MODE_IMAGE:
+        case ID_MODE_OVERDRAW:
             OnRange(hWnd, LOWORD(wParam), m_nMode, ID_MODE, m_options.mode, Modes);
             break;
 
@@ -95,6 +251,30 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
             OnToggle(hWnd, ID_MODE_STATS, m_options.stats);
             break;
 
+        case ID_MODE_PERSPECTIVE:
+            OnToggle(hWnd, ID_MODE_PERSPECTIVE, m_options.perspective);
+            break;
+
+        case ID_MODE_CULL:
+            OnToggle(hWnd, ID_MODE_CULL, m_options.cull);
+            break;
+
+        case ID_MODE_SORT:
+            OnToggle(hWnd, ID_MODE_SORT, m_options.sort);
+            break;
+
+        case ID_MODE_TILED:
+            OnToggle(hWnd, ID_MODE_TILED, m_options.tiled);
+            break;
+
+        case ID_MODE_MIPMAP:
+            OnToggle(hWnd, ID_MODE_MIPMAP, m_options.mipmap);
+            break;
+
+        case ID_MODE_PIPELINED:
+            OnToggle(hWnd, ID_MODE_PIPELINED, m_options.pipelined);
+            break;
+
         case ID_MODE_TRACK:
             OnToggle(hWnd, ID_MODE_TRACK, m_options.track);
             if(m_options.track) SetTimer(hWnd, WM_TIMER, 1, nullptr);
@@ -126,20 +306,50 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
             OnRange(hWnd, LOWORD(wParam), m_nOffset, ID_OFFSET, m_options.offset, Offsets);
             break;
 
+        case ID_THREADS_AUTO:
+        case ID_THREADS_1:
+        case ID_THREADS_2:
+        case ID_THREADS_4:
+        case ID_THREADS_8:
+        case ID_THREADS_16:
+            OnRange(hWnd, LOWORD(wParam), m_nThreads, ID_THREADS, m_options.threads, Threads);
+            break;
+
+        case ID_DEPTH_FIXED32:
+        case ID_DEPTH_UNORM16:
+        case ID_DEPTH_FLOAT32:
+            OnRange(hWnd, LOWORD(wParam), m_nDepth, ID_DEPTH, m_options.depth, Depths);
+            break;
+
         case ID_ABOUT:
             DialogBox(hInst, MAKEINTRESOURCE(ID_ABOUT), hWnd, About);
             break;
 
+        case ID_SAVE_TRACE:
+            // the frames the profiler kept, for chrome://tracing or ui.perfetto.dev
+            if(FILE* file = fopen("d3trace.json", "w"))
+            {
+                _pThread->Exclusive([file] { _pRender->Profiler().WriteTrace(file); });
+                fclose(file);
+            }
+            break;
+
         case ID_EXIT:
             DestroyWindow(hWnd);
             break;
         }
+        Animate(hWnd);
         InvalidateRect(hWnd, nullptr, false);
         return 0;
     }
 
     case WM_TIMER:
-        if(m_options.track)
+        if(wParam == AnimateTimer)
+        {
+            if(_pThread)
+                _pThread->Step();
+        }
+        else if(m_options.track)
         {
             _eye = { 0, 0, 100, 0 };
             JOYINFOEX joyInfo = { sizeof(JOYINFOEX), JOY_RETURNALL, };
@@ -151,13 +361,13 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
                          ((float(joyInfo.dwZpos) - 32768) *  50 / 32768) + 100,
                         -((float(joyInfo.dwRpos) - 32768) * 180 / 32768) };
             }
+            Submit(hWnd);
         }
         break;
 
     case WM_MOUSEMOVE:
         if(!m_options.track)
         {
-            static uint count = 0;
             if(wParam == (MK_CONTROL | MK_LBUTTON))
             {
                 RECT rect;
@@ -165,9 +375,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
                 _eye = { (float)MulDiv(LOWORD(lParam), 200, rect.right) - 100,
                        -((float)MulDiv(HIWORD(lParam), 200, rect.bottom) - 100),
                         _eye.Z(), _eye.W() };
-                static uint count = 0;
-                if(++count % 20 == 0)
-                    InvalidateRect(hWnd, nullptr, false);
+                Submit(hWnd);
             } else if(wParam == (MK_SHIFT | MK_LBUTTON))
             {
                 RECT rect;
@@ -175,8 +383,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
                 _eye = { _eye.X(), _eye.Y(),
                          (float)MulDiv(HIWORD(lParam), 100, rect.bottom) + 50,
                        -((float)MulDiv(LOWORD(lParam), 360, rect.right) - 180) };
-                if(++count % 20 == 0)
-                    InvalidateRect(hWnd, nullptr, false);
+                Submit(hWnd);
             }
         }
         break;
@@ -185,12 +392,16 @@ LRESULT CALLBACK WndProc(HWND hWnd, uint message, WPARAM wParam, LPARAM lParam)
     {
         PAINTSTRUCT ps;
         HDC hdc = BeginPaint(hWnd, &ps);
-        if(_pRender)
-            _pRender->Draw(hdc, m_options, _eye);
+        if(_pThread)
+            Paint(hWnd, hdc);
         EndPaint(hWnd, &ps);
         break;
     }
     case WM_DESTROY:
+        delete _pThread;        // joins the render thread, then the renderer's workers go
+        _pThread = nullptr;
+        delete _pRender;
+        _pRender = nullptr;
         PostQuitMessage(0);
     default:
         break;
@@ -236,6 +447,7 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int)
 {
     HWND hWnd = nullptr;
     hInst = hInstance;
+    s_uiThread = true;
     int ret = 0;
 
     if(hWnd = AppInit())
@@ -6,19 +6,28 @@
 #define ID_ICON                         101
 #define ID_ABOUT                        102
 #define ID_EXIT                         103
+#define ID_SAVE_TRACE                   104
 #define ID_SURFACES                     200
 #define ID_UP                           200
 #define ID_FRANKIE                      201
 #define ID_EARTH                        202
 #define ID_GRID                         203
+#define ID_SURFACES_LAST                203
 #define ID_MODE                         300
 #define ID_MODE_FIRST                   300
 #define ID_MODE_WIREFRAME               300
 #define ID_MODE_DEFAULT                 300
 #define ID_MODE_DEPTH_BUFFER            301
 #define ID_MODE_IMAGE                   302
-#define ID_MODE_LAST                    302
+#define ID_MODE_OVERDRAW                303
+#define ID_MODE_LAST                    303
 #define ID_MODE_STATS                   310
+#define ID_MODE_PERSPECTIVE             311
+#define ID_MODE_CULL                    312
+#define ID_MODE_SORT                    313
+#define ID_MODE_TILED                   314
+#define ID_MODE_MIPMAP                  315
+#define ID_MODE_PIPELINED               316
 #define ID_MODE_TRACK                   320
 #define ID_MODEL                        400
 #define ID_MODEL_FIRST                  400
@@ -56,6 +65,23 @@
 #define ID_SPEED_SLOW                   702
 #define ID_SPEED_LAST                   702
 #define ID_SPEED_PAUSE                  710
+#define ID_THREADS                      800
+#define ID_THREADS_FIRST                800
+#define ID_THREADS_AUTO                 800
+#define ID_THREADS_DEFAULT              800
+#define ID_THREADS_1                    801
+#define ID_THREADS_2                    802
+#define ID_THREADS_4                    803
+#define ID_THREADS_8                    804
+#define ID_THREADS_16                   805
+#define ID_THREADS_LAST                 805
+#define ID_DEPTH                        900
+#define ID_DEPTH_FIRST                  900
+#define ID_DEPTH_FIXED32                900
+#define ID_DEPTH_DEFAULT                900
+#define ID_DEPTH_UNORM16                901
+#define ID_DEPTH_FLOAT32                902
+#define ID_DEPTH_LAST                   902
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
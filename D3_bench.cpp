@@ -0,0 +1,627 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+
+#include "D3.h"
+#include "Render.h"
+#include "Raster.h"
+#include "Framebuffer.h"
+
+/*/////////////////////////////////////////////////////////////////////
+//  d3bench: headless micro & frame benchmarks
+///////////////////////////////////////////////////////////////////////
+//
+//    d3bench [options]
+//      --filter text       only the benchmarks whose name contains text
+//      --json file         results as JSON to file, default stdout
+//      --compare file      fail (exit 1) when a benchmark is slower than
+//                          in that earlier --json file by over --threshold
+//      --threshold percent default 10
+//      --time ms           measuring time per benchmark, default 200
+//      --threads n         raster threads for the frames, default 0 (one per core)
+//      --isa scalar|sse|avx|avx2   lowers the instruction set, see Simd::SetIsa()
+//      --data dir          where the *.bmp surfaces are, default the source tree
+//      --trace file        the stage timings of the last spinning frames, Chrome trace JSON
+//
+//    first the check/depth/... checks render the default scene with each depth
+//    format & fail (exit 1) when it differs from fixed32 in over 0.01% of the
+//    pixels; --filter selects them like the benchmarks
+//
+//    each benchmark runs batches of iterations sized to a fifth of the
+//    measuring time; the median batch gives ns per iteration
+//
+//    d3bench --json base.json              // before a change
+//    d3bench --compare base.json           // after it
+//*/
+
+#ifndef D3_DATA_DIR
+#define D3_DATA_DIR "."
+#endif
+
+using namespace D3;
+using Clock = std::chrono::steady_clock;
+
+// count every heap allocation, so frame results show the steady state makes none
+void* operator new(size_t size)
+{
+    Simd::Allocations()++;
+    if(void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Result
+{
+    std::string name;
+    uint64_t    iterations; // per batch
+    double      ns;         // median batch, per iteration
+    double      minNs;      // fastest batch, per iteration
+    double      allocs;     // per iteration
+};
+
+struct Bench
+{
+    std::string filter;
+    double      seconds = 0.2;
+    uint        threads = 0;
+    std::string data    = D3_DATA_DIR;
+    const char* trace   = nullptr;
+    std::vector<Result> results;
+
+    bool Wanted(const std::string& name) const
+        { return filter.empty() || (name.find(filter) != std::string::npos); }
+
+    // op(n) runs n iterations; it runs once untimed first, to warm caches & allocations
+    void Run(const std::string& name, const std::function<void(uint64_t)>& op)
+    {
+        if(!Wanted(name))
+            return;
+
+        const int batches = 5;
+        op(1);
+        uint64_t n = 1;
+        for (;;)
+        {
+            Clock::time_point start = Clock::now();
+            op(n);
+            double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            if((elapsed >= seconds / batches) || (n >= (uint64_t(1) << 40)))
+                break;
+            n = (elapsed > 0) ? std::max(n + 1, uint64_t(n * (seconds / batches) / elapsed * 1.1)) : n * 10;
+        }
+
+        std::vector<double> times(batches);
+        uint64_t allocs = Simd::Allocations();
+        for (int b = 0; b < batches; b++)
+        {
+            Clock::time_point start = Clock::now();
+            op(n);
+            times[b] = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / n;
+        }
+        allocs = Simd::Allocations() - allocs;
+        std::sort(times.begin(), times.end());
+
+        Result result = { name, n, times[batches / 2], times[0], double(allocs) / (double(n) * batches) };
+        results.push_back(result);
+        fprintf(stderr, "%-48s %14.1f ns %12llu its %8.2f allocs\n", name.c_str(), result.ns,
+                (unsigned long long)n, result.allocs);
+    }
+};
+
+// keeps the compiler from dropping a computation whose result is otherwise unused
+static volatile float s_sink;
+
+static const char* IsaName(Simd::Isa isa)
+{
+    switch(isa)
+    {
+    default:
+    case Simd::Isa::Scalar: return "scalar";
+    case Simd::Isa::SSE:    return "sse";
+    case Simd::Isa::AVX:    return "avx";
+    case Simd::Isa::AVX2:   return "avx2";
+    }
+}
+
+static const char* ModeName(Options::Mode mode)
+{
+    switch(mode)
+    {
+    default:
+    case Options::Wireframe:    return "wireframe";
+    case Options::DepthBuffer:  return "depth";
+    case Options::Image:        return "image";
+    case Options::Overdraw:     return "overdraw";
+    }
+}
+
+static const char* ModelName(Options::Model model)
+{
+    switch(model)
+    {
+    default:
+    case Options::Up:           return "up";
+    case Options::Frankie:      return "frankie";
+    case Options::Mixed:        return "mixed";
+    case Options::Halfempty:    return "halfempty";
+    case Options::Earth:        return "earth";
+    case Options::Grid:         return "grid";
+    }
+}
+
+// a size x size grid of quads in the z = 0 plane, neighbouring quads share their corners
+static std::vector<Polygon> MakeGrid(int size)
+{
+    std::vector<Polygon> polygons;
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            float x0 = float(x) / size * 2 - 1, x1 = float(x + 1) / size * 2 - 1;
+            float y0 = float(y) / size * 2 - 1, y1 = float(y + 1) / size * 2 - 1;
+            Polygon a = {};
+            a.tripple3.p0 = { x0, y0, 0 };
+            a.tripple3.p1 = { x1, y1, 0 };
+            a.tripple3.p2 = { x0, y1, 0 };
+            a.tripple2.p0 = { 0, 0 };
+            a.tripple2.p1 = { 1, 1 };
+            a.tripple2.p2 = { 0, 1 };
+            Polygon b = a;
+            b.tripple3.p0 = { x1, y1, 0 };
+            b.tripple3.p1 = { x0, y0, 0 };
+            b.tripple3.p2 = { x1, y0, 0 };
+            b.tripple2.p0 = { 1, 1 };
+            b.tripple2.p1 = { 0, 0 };
+            b.tripple2.p2 = { 1, 0 };
+            polygons.push_back(a);
+            polygons.push_back(b);
+        }
+    }
+    return polygons;
+}
+
+static void BenchMath(Bench& bench)
+{
+    bench.Run("matrix/multiply", [](uint64_t n)
+    {
+        Matrix m = Identity();
+        Matrix r = RotateX(1) * RotateY(2) * RotateZ(3);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            m = m * r;
+        }
+        s_sink = m[0][0];
+    });
+
+    for (int size : { 8, 64 })
+    {
+        std::vector<Polygon> polygons = MakeGrid(size);
+        std::string grid = "grid" + std::to_string(size);
+
+        // welding: a quad adds about one new point, its other five are found in the index
+        Mesh mesh;
+        bench.Run("mesh/addpoint/" + grid, [&](uint64_t n)
+        {
+            for (uint64_t i = 0; i < n; i++)
+            {
+                mesh.Clear();
+                mesh.AddPolygons(polygons);
+            }
+            s_sink = float(mesh.Count());
+        });
+
+        Mesh model;
+        model.AddPolygons(polygons);
+        Matrix rotate = RotateY(1);
+        bench.Run("mesh/multiply/" + grid, [&](uint64_t n)
+        {
+            for (uint64_t i = 0; i < n; i++)
+            {
+                model *= rotate;
+            }
+            s_sink = model[0].tripple3.p0.X();
+        });
+
+        // four instances placed as the renderer places its models
+        World world;
+        Screen screen;
+        Rect rect;
+        rect.right  = 1280;
+        rect.bottom = 720;
+        for (int i = 0; i < 4; i++)
+        {
+            world.Add(model, Scale(10, 10, 10) * RotateY(float(30 * i)) * Translate(float(i % 2 ? 15 : -15), float(i / 2 ? 15 : -15), float(-20 * i)));
+        }
+        bench.Run("screen/transform/" + grid, [&](uint64_t n)
+        {
+            for (uint64_t i = 0; i < n; i++)
+            {
+                ScreenTrasnform(world, rect, Point(0, 0, 100), Point(0, 0, 0), Vector(0, 1, 0), 45, 1, 100, screen);
+            }
+            s_sink = float(screen.Count());
+        });
+    }
+}
+
+// the depth to gray pass alone, over a 1920x1080 buffer of made up keys, at every instruction set
+template<class Format>
+static void BenchGray(Bench& bench, const char* format)
+{
+    const int count = 1920 * 1080;
+    std::vector<typename Format::Type> depth(count);
+    std::vector<uint32_t> pixels(count);
+    // a quarter left clear, as the background is, the rest anywhere between the planes
+    uint32_t seed = 1;
+    uint32_t min  = UINT32_MAX;
+    uint32_t max  = 0;
+    for (auto& z : depth)
+    {
+        seed = seed * 1664525 + 1013904223;
+        z = ((seed >> 8) & 3) ? Format::Encode(1 + float(seed >> 10) / (1 << 22) * 98) : Format::Clear();
+        if(z != Format::Clear())
+        {
+            min = std::min(min, Format::Key(z));
+            max = std::max(max, Format::Key(z));
+        }
+    }
+    const Raster::Gray gray(min, max);
+
+    Simd::Isa active = Simd::ActiveIsa();
+    for (Simd::Isa isa : { Simd::Isa::Scalar, Simd::Isa::SSE, Simd::Isa::AVX2 })
+    {
+        if(isa > active)
+            continue;   // not on this cpu, or lowered by --isa
+        Simd::SetIsa(isa);
+
+        Raster::GrayFunc<Format> kernel = Raster::SelectGray<Format>();
+        bench.Run(std::string("gray/") + format + "/" + IsaName(isa), [&](uint64_t n)
+        {
+            for (uint64_t i = 0; i < n; i++)
+            {
+                kernel(depth.data(), count, pixels.data(), gray);
+            }
+            s_sink = float(pixels[count / 2]);
+        });
+    }
+    Simd::SetIsa(active);
+}
+
+static void BenchFrames(Bench& bench, const char** surfaces)
+{
+    struct Size { int width, height; };
+    const Size sizes[] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+
+    std::unique_ptr<IRender> render(IRender::Create({ surfaces }));
+    MemoryFramebuffer frame;
+    Point eye = { 0, 0, 100, 0 };
+
+    // the models spin a degree a frame, as the app's animation does
+    for (Options::Mode mode : { Options::Wireframe, Options::DepthBuffer, Options::Image, Options::Overdraw })
+    {
+        for (int model = Options::Up; model <= Options::Grid; model++)
+        {
+            for (const Size& size : sizes)
+            {
+                Options options = { surfaces, 10, 15 };
+                options.mode    = mode;
+                options.model   = Options::Model(model);
+                options.threads = bench.threads;
+                std::string name = std::string("frame/") + ModeName(mode) + "/" + ModelName(options.model) + "/" +
+                                   std::to_string(size.width) + "x" + std::to_string(size.height);
+                frame.Resize(size.width, size.height);
+                bench.Run(name, [&](uint64_t n)
+                {
+                    for (uint64_t i = 0; i < n; i++)
+                    {
+                        render->Timer();
+                        render->Draw(frame, options, eye);
+                    }
+                });
+            }
+        }
+    }
+
+    if(bench.trace)
+    {
+        FILE* file = fopen(bench.trace, "w");
+        if(!file || !render->Profiler().WriteTrace(file))
+            fprintf(stderr, "d3bench: can't write %s\n", bench.trace);
+        if(file)
+            fclose(file);
+    }
+
+    // the same spinning frames with the geometry of each overlapping the raster of the one before
+    for (bool pipelined : { false, true })
+    {
+        for (Options::Model model : { Options::Mixed, Options::Earth })
+        {
+            Options options = { surfaces, 10, 15 };
+            options.mode      = Options::Image;
+            options.model     = model;
+            options.pipelined = pipelined;
+            options.threads   = bench.threads;
+            std::string name = std::string("pipeline/") + (pipelined ? "pipelined/" : "serial/") + ModelName(model) + "/1280x720";
+            frame.Resize(1280, 720);
+            bench.Run(name, [&](uint64_t n)
+            {
+                for (uint64_t i = 0; i < n; i++)
+                {
+                    render->Timer();
+                    render->Draw(frame, options, eye);
+                }
+            });
+        }
+    }
+
+    // texture layout with no mip maps, so the full surface is sampled: the eye rolled 0 has
+    // screen rows walk texture rows, rolled 90 walks texture columns, where the linear layout
+    // touches a new cache line per pixel & the 4x4 tiles don't; earth's surface outgrows the
+    // caches, frankie's doesn't
+    for (bool tiled : { false, true })
+    {
+        for (Options::Model model : { Options::Frankie, Options::Earth })
+        {
+            for (int roll : { 0, 90 })
+            {
+                Options options = { surfaces, 10, 15 };
+                options.mode    = Options::Image;
+                options.model   = model;
+                options.tiled   = tiled;
+                options.mipmap  = false;
+                options.threads = bench.threads;
+                Point rolled = { eye.X(), eye.Y(), eye.Z(), float(roll) };
+                std::unique_ptr<IRender> still(IRender::Create({ surfaces }));
+                std::string name = std::string("layout/") + (tiled ? "tiled/" : "linear/") + ModelName(model) +
+                                   "/roll" + std::to_string(roll);
+                frame.Resize(1280, 960);
+                bench.Run(name, [&](uint64_t n)
+                {
+                    for (uint64_t i = 0; i < n; i++)
+                    {
+                        still->Draw(frame, options, rolled);
+                    }
+                });
+            }
+        }
+    }
+}
+
+// the smaller depth formats must hide the same surfaces as DepthFixed: the default scene, every
+// model with & without culling, at a few angles; a handful of pixels where surfaces meet may
+// differ, more means the format lost the depth precision the scene needs
+static int CheckDepthFormats(const Bench& bench, const char** surfaces)
+{
+    const double limit = 0.0001;    // of the pixels compared
+    const Point  eye   = { 0, 0, 100, 0 };
+    int failed = 0;
+
+    MemoryFramebuffer expected, frame;
+    expected.Resize(1280, 720);
+    frame.Resize(1280, 720);
+    for (Options::DepthFormat depth : { Options::Unorm16, Options::Float32 })
+    {
+        for (int model = Options::Up; model <= Options::Grid; model++)
+        {
+            for (bool cull : { true, false })
+            {
+                std::string name = std::string("check/depth/") + (depth == Options::Unorm16 ? "unorm16/" : "float32/") +
+                                   ModelName(Options::Model(model)) + (cull ? "/cull" : "/nocull");
+                if(!bench.Wanted(name))
+                    continue;
+
+                Options options = { surfaces, 10, 15 };
+                options.mode    = Options::Image;
+                options.model   = Options::Model(model);
+                options.cull    = cull;
+                options.threads = bench.threads;
+                std::unique_ptr<IRender> fixed(IRender::Create({ surfaces }));
+                std::unique_ptr<IRender> tested(IRender::Create({ surfaces }));
+
+                uint64_t pixels = 0, differ = 0;
+                for (int turn : { 0, 37, 53, 61 })      // at 0, 37, 90 & 151 degrees
+                {
+                    for (int i = 0; i < turn; i++)
+                    {
+                        fixed->Timer();
+                        tested->Timer();
+                    }
+                    options.depth = Options::Fixed32;
+                    fixed->Draw(expected, options, eye);
+                    options.depth = depth;
+                    tested->Draw(frame, options, eye);
+
+                    const uint32_t* a = expected.Pixels(Framebuffer::Image);
+                    const uint32_t* b = frame.Pixels(Framebuffer::Image);
+                    for (uint32_t i = 0; i < frame.Size(); i++)
+                    {
+                        differ += (a[i] != b[i]) ? 1 : 0;
+                    }
+                    pixels += frame.Size();
+                }
+
+                bool ok = differ <= pixels * limit;
+                fprintf(stderr, "%-40s %6llu of %llu pixels differ from fixed32%s\n", name.c_str(),
+                        (unsigned long long)differ, (unsigned long long)pixels, ok ? "" : ", FAILED");
+                failed += ok ? 0 : 1;
+            }
+        }
+    }
+    return failed;
+}
+
+static bool WriteJson(const Bench& bench, FILE* file)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"isa\": \"%s\",\n", IsaName(Simd::ActiveIsa()));
+    fprintf(file, "  \"threads\": %u,\n", bench.threads);
+    fprintf(file, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < bench.results.size(); i++)
+    {
+        const Result& r = bench.results[i];
+        fprintf(file, "    { \"name\": \"%s\", \"iterations\": %llu, \"ns\": %.1f, \"min_ns\": %.1f, \"allocs\": %.2f }%s\n",
+                r.name.c_str(), (unsigned long long)r.iterations, r.ns, r.minNs, r.allocs,
+                (i + 1 < bench.results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return !ferror(file);
+}
+
+// name -> ns of a file written by WriteJson(), one benchmark a line
+static bool ReadJson(const char* path, std::map<std::string, double>& baseline)
+{
+    FILE* file = fopen(path, "r");
+    if(!file)
+        return false;
+
+    char line[1024];
+    while(fgets(line, sizeof(line), file))
+    {
+        const char* name = strstr(line, "\"name\": \"");
+        const char* ns   = strstr(line, "\"ns\": ");
+        if(!name || !ns)
+            continue;
+        name += strlen("\"name\": \"");
+        const char* end = strchr(name, '"');
+        if(end)
+            baseline[std::string(name, end)] = atof(ns + strlen("\"ns\": "));
+    }
+    fclose(file);
+    return true;
+}
+
+// prints every benchmark against the baseline, returns the count slower by more than threshold percent
+static int Compare(const Bench& bench, const std::map<std::string, double>& baseline, double threshold)
+{
+    int regressed = 0;
+    fprintf(stderr, "\n%-48s %14s %14s %9s\n", "benchmark", "baseline ns", "ns", "change");
+    for (const Result& r : bench.results)
+    {
+        auto it = baseline.find(r.name);
+        if(it == baseline.end())
+        {
+            fprintf(stderr, "%-48s %14s %14.1f %9s\n", r.name.c_str(), "-", r.ns, "new");
+            continue;
+        }
+        double change = (it->second > 0) ? (r.ns / it->second - 1) * 100 : 0;
+        bool slower = change > threshold;
+        regressed += slower ? 1 : 0;
+        fprintf(stderr, "%-48s %14.1f %14.1f %+8.1f%%%s\n", r.name.c_str(), it->second, r.ns, change,
+                slower ? "  REGRESSED" : "");
+    }
+    fprintf(stderr, "%d of %zu benchmarks regressed by more than %.1f%%\n", regressed, bench.results.size(), threshold);
+    return regressed;
+}
+
+static int Usage()
+{
+    fprintf(stderr, "usage: d3bench [--filter text] [--json file] [--compare file] [--threshold percent]\n"
+                    "               [--time ms] [--threads n] [--isa scalar|sse|avx|avx2] [--data dir] [--trace file]\n");
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    Bench bench;
+    const char* json    = nullptr;
+    const char* compare = nullptr;
+    double threshold    = 10;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(i + 1 >= argc)
+            return Usage();
+        const char* value = argv[++i];
+        if(arg == "--filter")           bench.filter  = value;
+        else if(arg == "--json")        json          = value;
+        else if(arg == "--compare")     compare       = value;
+        else if(arg == "--threshold")   threshold     = atof(value);
+        else if(arg == "--time")        bench.seconds = atof(value) / 1000;
+        else if(arg == "--threads")     bench.threads = uint(atoi(value));
+        else if(arg == "--data")        bench.data    = value;
+        else if(arg == "--trace")       bench.trace   = value;
+        else if(arg == "--isa")
+        {
+            Simd::Isa isa = Simd::Isa::AVX2;
+            while((isa != Simd::Isa::Scalar) && (std::string(IsaName(isa)) != value))
+            {
+                isa = Simd::Isa(int(isa) - 1);
+            }
+            if(std::string(IsaName(isa)) != value)
+                return Usage();
+            Simd::SetIsa(isa);
+        }
+        else
+            return Usage();
+    }
+
+    std::map<std::string, double> baseline;
+    if(compare && !ReadJson(compare, baseline))
+    {
+        fprintf(stderr, "d3bench: can't read %s\n", compare);
+        return 2;
+    }
+
+    std::string files[] = { bench.data + "/up.bmp", bench.data + "/frankie.bmp", bench.data + "/earth.bmp", bench.data + "/grid.bmp" };
+    const char* surfaces[] = { files[0].c_str(), files[1].c_str(), files[2].c_str(), files[3].c_str() };
+
+    fprintf(stderr, "d3bench: isa %s, threads %u, %.0f ms a benchmark\n", IsaName(Simd::ActiveIsa()), bench.threads, bench.seconds * 1000);
+    int failed = CheckDepthFormats(bench, surfaces);
+    BenchMath(bench);
+    BenchGray<Raster::DepthFixed>(bench, "fixed32");
+    BenchGray<Raster::DepthUnorm16>(bench, "unorm16");
+    BenchGray<Raster::DepthFloat>(bench, "float32");
+    BenchFrames(bench, surfaces);
+
+    if(json)
+    {
+        FILE* file = fopen(json, "w");
+        bool written = file && WriteJson(bench, file);
+        if(file)
+            fclose(file);
+        if(!written)
+        {
+            fprintf(stderr, "d3bench: can't write %s\n", json);
+            return 2;
+        }
+    }
+    else if(!compare)
+    {
+        WriteJson(bench, stdout);
+    }
+
+    if(failed)
+    {
+        fprintf(stderr, "d3bench: %d depth format checks failed\n", failed);
+        return 1;
+    }
+    if(compare)
+        return Compare(bench, baseline, threshold) ? 1 : 0;
+    return 0;
+}
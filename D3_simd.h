@@ -0,0 +1,390 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+/*/////////////////////////////////////////////////////////////////////
+//  Batch kernels over structure-of-arrays vertex streams
+///////////////////////////////////////////////////////////////////////
+//
+//    streams are separate x/y/z/w float arrays, aligned to Align bytes
+//    and padded to a multiple of Lanes, so every kernel runs whole
+//    8-wide (AVX), 4-wide (SSE) or 1-wide (scalar) iterations
+//
+//    Transform(matrix, src, dst, count);   // dst = src * matrix
+//    PerspectiveDivide(streams, count);    // xyz /= w, w = 1 / w (for perspective correct interpolation)
+//    Viewport(streams, count, matrix);     // xyz = xyz * scale + offset
+//    Project(matrix, view, src, dst, count); // all three fused in one pass
+//
+//    the active instruction set is detected once at startup and can be
+//    lowered with SetIsa() (eg. to compare against the scalar path)
+//*/
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define D3_SIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define D3_TARGET_AVX
+#define D3_TARGET_AVX2
+#else
+#include <immintrin.h>
+#define D3_TARGET_AVX __attribute__((target("avx")))
+#define D3_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace D3
+{
+    namespace Simd
+    {
+        const size_t Lanes = 8;     // widest kernel, streams are padded to this
+        const size_t Align = 32;    // one AVX register
+
+        inline size_t Padded(size_t count) { return (count + Lanes - 1) & ~(Lanes - 1); }
+
+        enum class Isa
+        {
+            Scalar,
+            SSE,
+            AVX,
+            AVX2,   // the vertex kernels use AVX, the raster kernels need AVX2
+        };
+
+        inline Isa DetectIsa()
+        {
+#if defined(D3_SIMD_X86) && defined(_MSC_VER)
+            int info[4] = {};
+            __cpuid(info, 1);
+            bool sse2    = (info[3] & (1 << 26)) != 0;
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx     = (info[2] & (1 << 28)) != 0;
+            __cpuidex(info, 7, 0);
+            bool avx2    = (info[1] & (1 << 5)) != 0;
+            if(osxsave && avx && ((_xgetbv(0) & 6) == 6)) return avx2 ? Isa::AVX2 : Isa::AVX;
+            if(sse2) return Isa::SSE;
+#elif defined(D3_SIMD_X86)
+            if(__builtin_cpu_supports("avx2")) return Isa::AVX2;
+            if(__builtin_cpu_supports("avx"))  return Isa::AVX;
+            if(__builtin_cpu_supports("sse2")) return Isa::SSE;
+#endif
+            return Isa::Scalar;
+        }
+
+        inline Isa& ActiveIsa()
+        {
+            static Isa s_isa = DetectIsa();
+            return s_isa;
+        }
+
+        inline void SetIsa(Isa isa)
+        {
+            ActiveIsa() = std::min(isa, DetectIsa());
+        }
+
+        // heap allocations so far: Allocator counts its own, the app's operator new the rest
+        inline std::atomic<uint64_t>& Allocations()
+        {
+            static std::atomic<uint64_t> s_nAllocations = {};
+            return s_nAllocations;
+        }
+
+        template<typename T>
+        class Allocator
+        {
+        public:
+            using value_type = T;
+
+            Allocator() {}
+            template<typename U> Allocator(const Allocator<U>&) {}
+
+            T* allocate(size_t n)
+            {
+#if defined(_MSC_VER)
+                void* p = _aligned_malloc(n * sizeof(T), Align);
+#else
+                void* p = nullptr;
+                if(posix_memalign(&p, Align, n * sizeof(T))) p = nullptr;
+#endif
+                if(!p) throw std::bad_alloc();
+                Allocations()++;
+                return (T*)p;
+            }
+            void deallocate(T* p, size_t)
+            {
+#if defined(_MSC_VER)
+                _aligned_free(p);
+#else
+                free(p);
+#endif
+            }
+
+            template<typename U> bool operator == (const Allocator<U>&) const { return true; }
+            template<typename U> bool operator != (const Allocator<U>&) const { return false; }
+        };
+
+        struct Streams
+        {
+            float* x;
+            float* y;
+            float* z;
+            float* w;
+        };
+
+        // m is a row major 4x4 matrix, points are row vectors (p * m)
+        // the sums are accumulated in the same order as Data4::Multiply
+        // so every path produces bit identical results
+        inline void TransformScalar(const float* m, const Streams& src, const Streams& dst, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                float x = src.x[i], y = src.y[i], z = src.z[i], w = src.w[i];
+                dst.x[i] = x * m[0] + y * m[4] + z * m[8]  + w * m[12];
+                dst.y[i] = x * m[1] + y * m[5] + z * m[9]  + w * m[13];
+                dst.z[i] = x * m[2] + y * m[6] + z * m[10] + w * m[14];
+                dst.w[i] = x * m[3] + y * m[7] + z * m[11] + w * m[15];
+            }
+        }
+
+        inline void PerspectiveDivideScalar(const Streams& s, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                float w = s.w[i];
+                s.x[i] /= w;
+                s.y[i] /= w;
+                s.z[i] /= w;
+                s.w[i] = 1 / w;
+            }
+        }
+
+        inline void ViewportScalar(const Streams& s, size_t count, const float* m)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                s.x[i] = s.x[i] * m[0]  + m[12];
+                s.y[i] = s.y[i] * m[5]  + m[13];
+                s.z[i] = s.z[i] * m[10] + m[14];
+            }
+        }
+
+        inline void ProjectScalar(const float* m, const float* v, const Streams& src, const Streams& dst, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                float x = src.x[i], y = src.y[i], z = src.z[i], w = src.w[i];
+                float rw = x * m[3] + y * m[7] + z * m[11] + w * m[15];
+                dst.x[i] = (x * m[0] + y * m[4] + z * m[8]  + w * m[12]) / rw * v[0]  + v[12];
+                dst.y[i] = (x * m[1] + y * m[5] + z * m[9]  + w * m[13]) / rw * v[5]  + v[13];
+                dst.z[i] = (x * m[2] + y * m[6] + z * m[10] + w * m[14]) / rw * v[10] + v[14];
+                dst.w[i] = 1 / rw;
+            }
+        }
+
+#if defined(D3_SIMD_X86)
+        inline void TransformSSE(const float* m, const Streams& src, const Streams& dst, size_t count)
+        {
+            __m128 c[16];
+            for (int j = 0; j < 16; j++) c[j] = _mm_set1_ps(m[j]);
+
+            for (size_t i = 0; i < count; i += 4)
+            {
+                __m128 x = _mm_load_ps(src.x + i);
+                __m128 y = _mm_load_ps(src.y + i);
+                __m128 z = _mm_load_ps(src.z + i);
+                __m128 w = _mm_load_ps(src.w + i);
+                __m128 r[4];
+                for (int j = 0; j < 4; j++)
+                {
+                    r[j] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, c[j]), _mm_mul_ps(y, c[4 + j])),
+                                                 _mm_mul_ps(z, c[8 + j])), _mm_mul_ps(w, c[12 + j]));
+                }
+                _mm_store_ps(dst.x + i, r[0]);
+                _mm_store_ps(dst.y + i, r[1]);
+                _mm_store_ps(dst.z + i, r[2]);
+                _mm_store_ps(dst.w + i, r[3]);
+            }
+        }
+
+        inline void PerspectiveDivideSSE(const Streams& s, size_t count)
+        {
+            for (size_t i = 0; i < count; i += 4)
+            {
+                __m128 w = _mm_load_ps(s.w + i);
+                _mm_store_ps(s.x + i, _mm_div_ps(_mm_load_ps(s.x + i), w));
+                _mm_store_ps(s.y + i, _mm_div_ps(_mm_load_ps(s.y + i), w));
+                _mm_store_ps(s.z + i, _mm_div_ps(_mm_load_ps(s.z + i), w));
+                _mm_store_ps(s.w + i, _mm_div_ps(_mm_set1_ps(1), w));
+            }
+        }
+
+        inline void ViewportSSE(const Streams& s, size_t count, const float* m)
+        {
+            __m128 sx = _mm_set1_ps(m[0]),  sy = _mm_set1_ps(m[5]),  sz = _mm_set1_ps(m[10]);
+            __m128 ox = _mm_set1_ps(m[12]), oy = _mm_set1_ps(m[13]), oz = _mm_set1_ps(m[14]);
+            for (size_t i = 0; i < count; i += 4)
+            {
+                _mm_store_ps(s.x + i, _mm_add_ps(_mm_mul_ps(_mm_load_ps(s.x + i), sx), ox));
+                _mm_store_ps(s.y + i, _mm_add_ps(_mm_mul_ps(_mm_load_ps(s.y + i), sy), oy));
+                _mm_store_ps(s.z + i, _mm_add_ps(_mm_mul_ps(_mm_load_ps(s.z + i), sz), oz));
+            }
+        }
+
+        inline void ProjectSSE(const float* m, const float* v, const Streams& src, const Streams& dst, size_t count)
+        {
+            __m128 c[16];
+            for (int j = 0; j < 16; j++) c[j] = _mm_set1_ps(m[j]);
+            __m128 s[3] = { _mm_set1_ps(v[0]),  _mm_set1_ps(v[5]),  _mm_set1_ps(v[10]) };
+            __m128 o[3] = { _mm_set1_ps(v[12]), _mm_set1_ps(v[13]), _mm_set1_ps(v[14]) };
+            float* out[3] = { dst.x, dst.y, dst.z };
+
+            for (size_t i = 0; i < count; i += 4)
+            {
+                __m128 x = _mm_load_ps(src.x + i);
+                __m128 y = _mm_load_ps(src.y + i);
+                __m128 z = _mm_load_ps(src.z + i);
+                __m128 w = _mm_load_ps(src.w + i);
+                __m128 rw = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, c[3]), _mm_mul_ps(y, c[7])),
+                                                  _mm_mul_ps(z, c[11])), _mm_mul_ps(w, c[15]));
+                for (int j = 0; j < 3; j++)
+                {
+                    __m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, c[j]), _mm_mul_ps(y, c[4 + j])),
+                                                     _mm_mul_ps(z, c[8 + j])), _mm_mul_ps(w, c[12 + j]));
+                    _mm_store_ps(out[j] + i, _mm_add_ps(_mm_mul_ps(_mm_div_ps(r, rw), s[j]), o[j]));
+                }
+                _mm_store_ps(dst.w + i, _mm_div_ps(_mm_set1_ps(1), rw));
+            }
+        }
+
+        D3_TARGET_AVX inline void TransformAVX(const float* m, const Streams& src, const Streams& dst, size_t count)
+        {
+            __m256 c[16];
+            for (int j = 0; j < 16; j++) c[j] = _mm256_set1_ps(m[j]);
+
+            for (size_t i = 0; i < count; i += 8)
+            {
+                __m256 x = _mm256_load_ps(src.x + i);
+                __m256 y = _mm256_load_ps(src.y + i);
+                __m256 z = _mm256_load_ps(src.z + i);
+                __m256 w = _mm256_load_ps(src.w + i);
+                __m256 r[4];
+                for (int j = 0; j < 4; j++)
+                {
+                    r[j] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, c[j]), _mm256_mul_ps(y, c[4 + j])),
+                                                       _mm256_mul_ps(z, c[8 + j])), _mm256_mul_ps(w, c[12 + j]));
+                }
+                _mm256_store_ps(dst.x + i, r[0]);
+                _mm256_store_ps(dst.y + i, r[1]);
+                _mm256_store_ps(dst.z + i, r[2]);
+                _mm256_store_ps(dst.w + i, r[3]);
+            }
+        }
+
+        D3_TARGET_AVX inline void PerspectiveDivideAVX(const Streams& s, size_t count)
+        {
+            for (size_t i = 0; i < count; i += 8)
+            {
+                __m256 w = _mm256_load_ps(s.w + i);
+                _mm256_store_ps(s.x + i, _mm256_div_ps(_mm256_load_ps(s.x + i), w));
+                _mm256_store_ps(s.y + i, _mm256_div_ps(_mm256_load_ps(s.y + i), w));
+                _mm256_store_ps(s.z + i, _mm256_div_ps(_mm256_load_ps(s.z + i), w));
+                _mm256_store_ps(s.w + i, _mm256_div_ps(_mm256_set1_ps(1), w));
+            }
+        }
+
+        D3_TARGET_AVX inline void ViewportAVX(const Streams& s, size_t count, const float* m)
+        {
+            __m256 sx = _mm256_set1_ps(m[0]),  sy = _mm256_set1_ps(m[5]),  sz = _mm256_set1_ps(m[10]);
+            __m256 ox = _mm256_set1_ps(m[12]), oy = _mm256_set1_ps(m[13]), oz = _mm256_set1_ps(m[14]);
+            for (size_t i = 0; i < count; i += 8)
+            {
+                _mm256_store_ps(s.x + i, _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(s.x + i), sx), ox));
+                _mm256_store_ps(s.y + i, _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(s.y + i), sy), oy));
+                _mm256_store_ps(s.z + i, _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(s.z + i), sz), oz));
+            }
+        }
+        D3_TARGET_AVX inline void ProjectAVX(const float* m, const float* v, const Streams& src, const Streams& dst, size_t count)
+        {
+            __m256 c[16];
+            for (int j = 0; j < 16; j++) c[j] = _mm256_set1_ps(m[j]);
+            __m256 s[3] = { _mm256_set1_ps(v[0]),  _mm256_set1_ps(v[5]),  _mm256_set1_ps(v[10]) };
+            __m256 o[3] = { _mm256_set1_ps(v[12]), _mm256_set1_ps(v[13]), _mm256_set1_ps(v[14]) };
+            float* out[3] = { dst.x, dst.y, dst.z };
+
+            for (size_t i = 0; i < count; i += 8)
+            {
+                __m256 x = _mm256_load_ps(src.x + i);
+                __m256 y = _mm256_load_ps(src.y + i);
+                __m256 z = _mm256_load_ps(src.z + i);
+                __m256 w = _mm256_load_ps(src.w + i);
+                __m256 rw = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, c[3]), _mm256_mul_ps(y, c[7])),
+                                                        _mm256_mul_ps(z, c[11])), _mm256_mul_ps(w, c[15]));
+                for (int j = 0; j < 3; j++)
+                {
+                    __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, c[j]), _mm256_mul_ps(y, c[4 + j])),
+                                                           _mm256_mul_ps(z, c[8 + j])), _mm256_mul_ps(w, c[12 + j]));
+                    _mm256_store_ps(out[j] + i, _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(r, rw), s[j]), o[j]));
+                }
+                _mm256_store_ps(dst.w + i, _mm256_div_ps(_mm256_set1_ps(1), rw));
+            }
+        }
+#endif
+
+        // count must be padded (see Padded()), src and dst may be the same streams
+        inline void Transform(const float* m, const Streams& src, const Streams& dst, size_t count)
+        {
+            switch(ActiveIsa())
+            {
+#if defined(D3_SIMD_X86)
+            case Isa::AVX2:
+            case Isa::AVX: TransformAVX(m, src, dst, count); break;
+            case Isa::SSE: TransformSSE(m, src, dst, count); break;
+#endif
+            default:       TransformScalar(m, src, dst, count); break;
+            }
+        }
+
+        inline void PerspectiveDivide(const Streams& s, size_t count)
+        {
+            switch(ActiveIsa())
+            {
+#if defined(D3_SIMD_X86)
+            case Isa::AVX2:
+            case Isa::AVX: PerspectiveDivideAVX(s, count); break;
+            case Isa::SSE: PerspectiveDivideSSE(s, count); break;
+#endif
+            default:       PerspectiveDivideScalar(s, count); break;
+            }
+        }
+
+        // m is a Viewport() matrix: only the diagonal and the translation row are used
+        inline void Viewport(const Streams& s, size_t count, const float* m)
+        {
+            switch(ActiveIsa())
+            {
+#if defined(D3_SIMD_X86)
+            case Isa::AVX2:
+            case Isa::AVX: ViewportAVX(s, count, m); break;
+            case Isa::SSE: ViewportSSE(s, count, m); break;
+#endif
+            default:       ViewportScalar(s, count, m); break;
+            }
+        }
+
+        // Transform, PerspectiveDivide & Viewport without writing the intermediate streams
+        inline void Project(const float* m, const float* v, const Streams& src, const Streams& dst, size_t count)
+        {
+            switch(ActiveIsa())
+            {
+#if defined(D3_SIMD_X86)
+            case Isa::AVX2:
+            case Isa::AVX: ProjectAVX(m, v, src, dst, count); break;
+            case Isa::SSE: ProjectSSE(m, v, src, dst, count); break;
+#endif
+            default:       ProjectScalar(m, v, src, dst, count); break;
+            }
+        }
+    }
+};  // namespace D3
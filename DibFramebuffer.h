@@ -0,0 +1,73 @@
+#pragma once
+
+#include <windows.h>
+
+#include "Framebuffer.h"
+
+/*/////////////////////////////////////////////////////////////////////
+//  DibFramebuffer: a Framebuffer GDI can draw into and present from
+///////////////////////////////////////////////////////////////////////
+//
+//    each plane is a top down DIB section selected into its own memory
+//    DC: the renderer writes the pixels, the app draws text over them
+//    and BitBlts straight from the plane, no copy per frame
+//*/
+
+class DibFramebuffer : public Framebuffer
+{
+    HDC         _dc[Planes]     = {};
+    HBITMAP     _bitmap[Planes] = {};
+    uint32_t*   _bits[Planes]   = {};
+
+    void Release()
+    {
+        for (int plane = 0; plane < Planes; plane++)
+        {
+            if(_dc[plane])
+                DeleteDC(_dc[plane]);
+            if(_bitmap[plane])
+                DeleteObject(_bitmap[plane]);
+            _dc[plane] = nullptr;
+            _bitmap[plane] = nullptr;
+            _bits[plane] = nullptr;
+        }
+    }
+
+public:
+    ~DibFramebuffer() { Release(); }
+
+    bool Resize(uint32_t width, uint32_t height) override
+    {
+        if((width == _width) && (height == _height) && _bits[Image])
+            return false;
+
+        Release();
+        _width  = width;
+        _height = height;
+
+        BITMAPINFO bmi = { sizeof(BITMAPINFOHEADER) };
+        bmi.bmiHeader.biWidth       = LONG(width ? width : 1);
+        bmi.bmiHeader.biHeight      = -LONG(height ? height : 1);   // top down
+        bmi.bmiHeader.biPlanes      = 1;
+        bmi.bmiHeader.biBitCount    = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+        for (int plane = 0; plane < Planes; plane++)
+        {
+            void* bits = nullptr;
+            _dc[plane] = CreateCompatibleDC(nullptr);
+            _bitmap[plane] = CreateDIBSection(_dc[plane], &bmi, DIB_RGB_COLORS, &bits, nullptr, 0);
+            _bits[plane] = (uint32_t*)bits;
+            SelectObject(_dc[plane], _bitmap[plane]);
+        }
+        return true;
+    }
+
+    uint32_t* Pixels(Plane plane) override
+    {
+        GdiFlush();     // GDI may still be drawing into the section
+        return _bits[plane];
+    }
+
+    // the plane selected for GDI drawing & BitBlt
+    HDC DC(Plane plane) { return _dc[plane]; }
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/*/////////////////////////////////////////////////////////////////////
+//  Framebuffer: what the renderer draws into
+///////////////////////////////////////////////////////////////////////
+//
+//    an image and a depth plane of 32 bit pixels, row major & top down,
+//    kept across frames and only reallocated when the size changes; the
+//    depth plane shows the depth buffer, whatever its format, as a gray scale
+//
+//    MemoryFramebuffer   // plain memory, headless
+//    DibFramebuffer      // DIB sections, see DibFramebuffer.h (Win32 only)
+//*/
+
+class Framebuffer
+{
+public:
+    enum Plane
+    {
+        Image,
+        Depth,
+        Planes
+    };
+
+protected:
+    uint32_t    _width  = 0;
+    uint32_t    _height = 0;
+
+public:
+    virtual ~Framebuffer() {}
+
+    uint32_t Width() const  { return _width; }
+    uint32_t Height() const { return _height; }
+    uint32_t Size() const   { return _width * _height; }
+
+    // true when the planes were reallocated (their contents are then undefined)
+    virtual bool Resize(uint32_t width, uint32_t height) = 0;
+
+    virtual uint32_t* Pixels(Plane plane) = 0;
+};
+
+class MemoryFramebuffer : public Framebuffer
+{
+    std::vector<uint32_t>   _planes[Planes];
+
+public:
+    bool Resize(uint32_t width, uint32_t height) override
+    {
+        if((width == _width) && (height == _height) && !_planes[Image].empty())
+            return false;
+
+        _width  = width;
+        _height = height;
+        for (auto& plane : _planes)
+        {
+            plane.assign(Size() ? Size() : 1, 0);
+        }
+        return true;
+    }
+
+    uint32_t* Pixels(Plane plane) override { return _planes[plane].data(); }
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+
+/*/////////////////////////////////////////////////////////////////////
+//  Profile: per stage frame timing
+///////////////////////////////////////////////////////////////////////
+//
+//    scoped timers around the pipeline stages record into a ring of the
+//    last Frames frames: rolling percentiles for the stats overlay and a
+//    Chrome trace (chrome://tracing, ui.perfetto.dev) of the same frames
+//
+//    Profile::Profiler profiler;
+//    D3_PROFILE_FRAME(profiler);                   // a frame starts
+//    { D3_PROFILE_SCOPE(profiler, Profile::Raster); ... }
+//    profiler.Percentiles(Profile::Raster, ms);    // p50, p95 & p99
+//    profiler.WriteTrace(file);
+//
+//    built with D3_PROFILE=0 the macros expand to nothing, nothing is
+//    recorded and the percentiles stay 0
+//*/
+
+#ifndef D3_PROFILE
+#define D3_PROFILE 1
+#endif
+
+#if D3_PROFILE
+#define D3_PROFILE_CONCAT2(a, b) a##b
+#define D3_PROFILE_CONCAT(a, b) D3_PROFILE_CONCAT2(a, b)
+#define D3_PROFILE_FRAME(profiler) (profiler).NewFrame()
+#define D3_PROFILE_SCOPE(profiler, stage) D3::Profile::Scope D3_PROFILE_CONCAT(profileScope, __LINE__)(profiler, stage)
+#else
+#define D3_PROFILE_FRAME(profiler) ((void)0)
+#define D3_PROFILE_SCOPE(profiler, stage) ((void)0)
+#endif
+
+namespace D3
+{
+    namespace Profile
+    {
+        enum Stage
+        {
+            Draw,       // all of IRender::Draw, the stages below nest in it
+            World,      // CreateWorld & the front to back sort
+            Transform,  // ScreenTrasnform
+            Cull,
+            Bin,        // triangle setup & binning into tiles
+            Raster,     // the tiles, over the workers
+            Gray,       // depth buffer to gray scale
+            Heat,       // overdraw counts to colours
+            Wire,       // wire frame lines
+            Present,    // the front end: stats text & blit
+            Stages
+        };
+
+        inline const char* StageName(Stage stage)
+        {
+            static const char* s_names[Stages] = { "Draw", "World", "Transform", "Cull", "Bin", "Raster", "Gray", "Heat", "Wire", "Present" };
+            return s_names[stage];
+        }
+
+        using Clock = std::chrono::steady_clock;
+
+        class Profiler
+        {
+        public:
+            static const uint32_t Frames = 256;  // kept for the percentiles & the trace
+
+        private:
+            struct Event        // ns since _epoch, end 0 when the stage didn't run in the frame
+            {
+                int64_t start;
+                int64_t end;
+            };
+            struct Frame
+            {
+                Event   events[Stages];
+            };
+
+            Clock::time_point   _epoch = Clock::now();
+            Frame               _frames[Frames] = {};
+            uint64_t            _count  = 0;        // frames started, the current one is _count - 1
+            mutable int64_t     _scratch[Frames];   // Percentiles() sorts here, no allocation
+
+            Frame& Current() { return _frames[(_count - 1) % Frames]; }
+
+        public:
+            int64_t Now() const
+                { return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - _epoch).count(); }
+
+            void NewFrame()
+            {
+                _count++;
+                Current() = {};
+            }
+
+            // a stage run more than once a frame is kept as one span from the first start to the last end
+            void Record(Stage stage, int64_t start, int64_t end)
+            {
+                if(!_count)
+                    return;
+                Event& event = Current().events[stage];
+                if(!event.end)
+                    event.start = start;
+                event.end = std::max(end, start + 1);
+            }
+
+            // p50, p95 & p99 of the stage in ms over the frames kept, 0 when it didn't run;
+            // returns the count of frames the stage ran in
+            uint32_t Percentiles(Stage stage, double ms[3]) const
+            {
+                uint32_t n = 0;
+                uint32_t kept = uint32_t(std::min<uint64_t>(_count, Frames));
+                for (uint32_t i = 0; i < kept; i++)
+                {
+                    const Event& event = _frames[i].events[stage];
+                    if(event.end)
+                        _scratch[n++] = event.end - event.start;
+                }
+
+                const int percents[3] = { 50, 95, 99 };
+                for (int p = 0; p < 3; p++)
+                {
+                    ms[p] = 0;
+                    if(!n)
+                        continue;
+                    uint32_t rank = (percents[p] * n + 99) / 100;    // nearest rank
+                    std::nth_element(_scratch, _scratch + rank - 1, _scratch + n);
+                    ms[p] = double(_scratch[rank - 1]) / 1e6;
+                }
+                return n;
+            }
+
+            // the frames kept as Chrome trace events, one row per stage so nested stages stay readable
+            bool WriteTrace(FILE* file) const
+            {
+                fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+                for (int stage = 0; stage < Stages; stage++)
+                {
+                    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                            stage, StageName(Stage(stage)));
+                }
+                uint64_t first = (_count > Frames) ? _count - Frames : 0;
+                bool comma = false;
+                for (uint64_t frame = first; frame < _count; frame++)
+                {
+                    const Frame& f = _frames[frame % Frames];
+                    for (int stage = 0; stage < Stages; stage++)
+                    {
+                        const Event& event = f.events[stage];
+                        if(!event.end)
+                            continue;
+                        fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+                                comma ? ",\n" : "", StageName(Stage(stage)), stage, double(event.start) / 1000,
+                                double(event.end - event.start) / 1000, (unsigned long long)frame);
+                        comma = true;
+                    }
+                }
+                fprintf(file, "\n]}\n");
+                return !ferror(file);
+            }
+        };
+
+        class Scope
+        {
+            Profiler&   _profiler;
+            Stage       _stage;
+            int64_t     _start;
+
+        public:
+            Scope(Profiler& profiler, Stage stage) : _profiler(profiler), _stage(stage), _start(profiler.Now()) {}
+            ~Scope() { _profiler.Record(_stage, _start, _profiler.Now()); }
+
+            Scope(const Scope&) = delete;
+            Scope& operator = (const Scope&) = delete;
+        };
+    }
+};  // namespace D3
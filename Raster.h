@@ -0,0 +1,711 @@
+#pragma once
+
+#include <string.h>
+
+#include "D3_simd.h"
+
+/*/////////////////////////////////////////////////////////////////////
+//  Raster span kernels
+///////////////////////////////////////////////////////////////////////
+//
+//    a Row is one scanline of a set up triangle: edge functions and
+//    attributes at its first pixel plus their per pixel steps; the
+//    kernels walk it in 8 pixel spans doing the coverage test, the
+//    depth test & store, the texel fetch & store and the min/max depth
+//
+//    RowFunc<Format> row = SelectRow<Format>();  // AVX2, SSE2 or scalar
+//    row(row, count, depth, image, texture, counters);
+//
+//    the kernels are templated on the depth format, see DepthFixed:
+//    a depth is compared and stored in its own type and reported to the
+//    caller (min/max, hierarchical Z) as a key, smaller is nearer
+//
+//    every kernel derives a lane's attributes as span + step * lane and
+//    steps spans by step * 8, so they all produce bit identical images
+//
+//    perspective correct rows carry u/w, v/w & 1/w instead of u & v: the
+//    exact texel is divided out once per span end and interpolated
+//    linearly across the 8 pixels in between
+//
+//    GrayFunc<Format> gray = SelectGray<Format>();
+//    gray(depth, count, pixels, Gray(min, max));  // depth keys to gray, nothing drawn is white
+//
+//    RowOverdraw<Format> counts the covered pixels into image instead of
+//    texturing them, HeatMap() turns the counts into colours
+//*/
+
+namespace D3
+{
+    namespace Raster
+    {
+        const int Span = 8;
+
+        struct Row
+        {
+            int64_t     e[3];       // edge functions at the first pixel, >= 0 inside
+            int64_t     de[3];      // per pixel
+            float       z, dz;      // depth
+            float       u, du;      // texel x (or u/w)
+            float       v, dv;      // texel y (or v/w)
+            float       q, dq;      // 1/w
+            bool        perspective;
+        };
+
+        struct Texture
+        {
+            const uint32_t* texels; // null for depth only
+            int             width;
+            int             height;
+            int             tilesX; // tiles per row of a tiled surface, 0 for row major
+        };
+
+        // tiled surfaces store 4x4 texel tiles (a cache line) row by row, so a fetch
+        // walking in any direction stays in the line of its neighbours
+        const int TileShift = 2;
+        const int TileMask  = (1 << TileShift) - 1;
+
+        inline int TilesX(int width) { return (width + TileMask) >> TileShift; }
+        inline int TilesY(int height) { return (height + TileMask) >> TileShift; }
+
+        inline int TexelIndex(const Texture& texture, int u, int v)
+        {
+            if(!texture.tilesX)
+                return u + v * texture.width;
+            return ((((v >> TileShift) * texture.tilesX + (u >> TileShift)) << (2 * TileShift)) |
+                    ((v & TileMask) << TileShift) | (u & TileMask));
+        }
+
+        // the next mip level: each texel averages the (up to) 2x2 texels it covers, channel by channel
+        inline void Downsample(const uint32_t* src, int width, int height, uint32_t* dst)
+        {
+            int w = std::max(width / 2, 1);
+            int h = std::max(height / 2, 1);
+            for (int v = 0; v < h; v++)
+            {
+                int v0 = std::min(2 * v, height - 1), v1 = std::min(2 * v + 1, height - 1);
+                for (int u = 0; u < w; u++)
+                {
+                    int u0 = std::min(2 * u, width - 1), u1 = std::min(2 * u + 1, width - 1);
+                    uint32_t t[4] = { src[u0 + v0 * width], src[u1 + v0 * width], src[u0 + v1 * width], src[u1 + v1 * width] };
+                    uint32_t texel = 0;
+                    for (int shift = 0; shift < 32; shift += 8)
+                    {
+                        uint32_t sum = ((t[0] >> shift) & 0xff) + ((t[1] >> shift) & 0xff) + ((t[2] >> shift) & 0xff) + ((t[3] >> shift) & 0xff);
+                        texel |= ((sum + 2) / 4) << shift;
+                    }
+                    dst[u + v * w] = texel;
+                }
+            }
+        }
+
+        // row major to tiled, dst holds TilesX(width) * TilesY(height) tiles
+        inline void Tile(const uint32_t* src, int width, int height, uint32_t* dst)
+        {
+            Texture texture = { dst, width, height, TilesX(width) };
+            memset(dst, 0, sizeof(*dst) * TilesX(width) * TilesY(height) << (2 * TileShift));
+            for (int v = 0; v < height; v++)
+            {
+                for (int u = 0; u < width; u++)
+                {
+                    dst[TexelIndex(texture, u, v)] = src[u + v * width];
+                }
+            }
+        }
+
+        struct Counters
+        {
+            uint32_t    min;        // depth keys
+            uint32_t    max;
+            uint64_t    pixels;     // covered pixels, passed or not
+            uint64_t    written;    // covered pixels that passed the depth test
+            uint64_t    texels;     // fetched for written pixels inside the surface
+        };
+
+        inline int BitCount(uint32_t bits)
+        {
+            int count = 0;
+            for (; bits; bits &= bits - 1) count++;
+            return count;
+        }
+
+        // depth formats: the row's z is the screen z (0 at the near, 100 at the far plane)
+        // for DepthFixed & DepthUnorm16 and near / w for DepthFloat; every kernel encodes
+        // it with the same operations, so the formats stay bit identical across ISAs
+        //
+        // the far plane doesn't clip, so screen z keeps growing behind it towards
+        // ScreenZMax, its value at infinity: 100 * far / (far - near) for Render's planes
+        constexpr float ScreenZMax = 100.0f * 100.0f / (100.0f - 1.0f);
+        struct DepthFixed       // uint(z * 10000) in 32 bits, the original format
+        {
+            using Type = uint32_t;
+
+            static Type Clear() { return UINT32_MAX; }
+            static Type Encode(float z) { return uint32_t(int(z * 10000)); }
+            static bool Nearer(Type a, Type b) { return a < b; }
+            static uint32_t Key(Type d) { return d; }
+
+#if defined(D3_SIMD_X86)
+            // the 8 lanes of a full span that would pass
+            static int PassSSE2(const Type* depth, __m128 zLo, __m128 zHi)
+            {
+                const __m128  scale = _mm_set1_ps(10000);
+                const __m128i sign  = _mm_set1_epi32(int(0x80000000));
+                __m128i ddLo  = _mm_cvttps_epi32(_mm_mul_ps(zLo, scale));
+                __m128i ddHi  = _mm_cvttps_epi32(_mm_mul_ps(zHi, scale));
+                __m128i depLo = _mm_loadu_si128((const __m128i*)depth);
+                __m128i depHi = _mm_loadu_si128((const __m128i*)(depth + 4));
+                return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_xor_si128(depLo, sign), _mm_xor_si128(ddLo, sign)))) |
+                       _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_xor_si128(depHi, sign), _mm_xor_si128(ddHi, sign)))) << 4;
+            }
+
+            // tests the lanes in mask of a span, stores & returns the ones that pass; the pixel count
+            // only matters to DepthUnorm16, the masked load & store here never touch the rest
+            D3_TARGET_AVX2 static __m256i TestAVX2(Type* depth, int, __m256 z, __m256i mask, __m256i& keys)
+            {
+                const __m256i sign = _mm256_set1_epi32(int(0x80000000));
+                __m256i dd   = _mm256_cvttps_epi32(_mm256_mul_ps(z, _mm256_set1_ps(10000)));
+                __m256i dep  = _mm256_maskload_epi32((const int*)depth, mask);
+                __m256i pass = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_xor_si256(dep, sign), _mm256_xor_si256(dd, sign)));
+                if(!_mm256_testz_si256(pass, pass))
+                    _mm256_maskstore_epi32((int*)depth, pass, dd);
+                keys = dd;
+                return pass;
+            }
+
+            static __m128i KeysSSE2(const Type* depth) { return _mm_loadu_si128((const __m128i*)depth); }
+            D3_TARGET_AVX2 static __m256i KeysAVX2(const Type* depth) { return _mm256_loadu_si256((const __m256i*)depth); }
+#endif
+        };
+
+        // z / ScreenZMax as a 16 bit unorm: half the traffic, for bandwidth bound machines; the
+        // whole range screen z takes maps below Clear(), so nothing visible saturates, and
+        // Render stretches each frame's depths over that range first
+        struct DepthUnorm16
+        {
+            using Type = uint16_t;
+
+            static constexpr float Scale = float(UINT16_MAX - 1) / ScreenZMax;
+
+            static Type Clear() { return UINT16_MAX; }
+            static Type Encode(float z)
+            {
+                z = z > 0 ? z : 0;          // NaN too
+                z = z < ScreenZMax ? z : ScreenZMax;
+                return uint16_t(int(z * Scale));
+            }
+            static bool Nearer(Type a, Type b) { return a < b; }
+            static uint32_t Key(Type d) { return d; }
+
+#if defined(D3_SIMD_X86)
+            // the clamps & conversion of Encode() in the same order
+            static __m128i EncodeSSE2(__m128 z)
+            {
+                z = _mm_min_ps(_mm_max_ps(z, _mm_setzero_ps()), _mm_set1_ps(ScreenZMax));
+                return _mm_cvttps_epi32(_mm_mul_ps(z, _mm_set1_ps(Scale)));
+            }
+
+            static int PassSSE2(const Type* depth, __m128 zLo, __m128 zHi)
+            {
+                // biased into signed 16 bits, SSE2 only packs & compares those
+                const __m128i bias32 = _mm_set1_epi32(0x8000);
+                const __m128i bias16 = _mm_set1_epi16(short(0x8000));
+                __m128i dd  = _mm_packs_epi32(_mm_sub_epi32(EncodeSSE2(zLo), bias32), _mm_sub_epi32(EncodeSSE2(zHi), bias32));
+                __m128i dep = _mm_xor_si128(_mm_loadu_si128((const __m128i*)depth), bias16);
+                __m128i pass = _mm_cmpgt_epi16(dep, dd);
+                return _mm_movemask_epi8(_mm_packs_epi16(pass, pass)) & 0xff;
+            }
+
+            D3_TARGET_AVX2 static __m256i TestAVX2(Type* depth, int n, __m256 z, __m256i mask, __m256i& keys)
+            {
+                // no 16 bit masked load & store: a partial span goes through a copy
+                alignas(16) Type copy[Span] = {};
+                Type* dst = (n >= Span) ? depth : copy;
+                if(n < Span)
+                    memcpy(copy, depth, n * sizeof(Type));
+
+                z = _mm256_min_ps(_mm256_max_ps(z, _mm256_setzero_ps()), _mm256_set1_ps(ScreenZMax));
+                __m256i dd   = _mm256_cvttps_epi32(_mm256_mul_ps(z, _mm256_set1_ps(Scale)));
+                __m256i dep  = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)dst));
+                __m256i pass = _mm256_and_si256(mask, _mm256_cmpgt_epi32(dep, dd));
+                if(!_mm256_testz_si256(pass, pass))
+                {
+                    __m256i merged = _mm256_blendv_epi8(dep, dd, pass);
+                    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(merged, merged), 0x08);
+                    _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(packed));
+                    if(n < Span)
+                        memcpy(depth, copy, n * sizeof(Type));
+                }
+                keys = dd;
+                return pass;
+            }
+
+            static __m128i KeysSSE2(const Type* depth)
+            {
+                return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)depth), _mm_setzero_si128());
+            }
+            D3_TARGET_AVX2 static __m256i KeysAVX2(const Type* depth)
+            {
+                return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)depth));
+            }
+#endif
+        };
+
+        // reversed Z: near / w as a float, 1 at the near plane falling towards 0 at infinity;
+        // the float exponent spends the precision where the projection squeezes depths together
+        struct DepthFloat
+        {
+            using Type = float;
+
+            static Type Clear() { return 0; }
+            static Type Encode(float z) { return z > 0 ? z : 0; }
+            static bool Nearer(Type a, Type b) { return a > b; }
+            static uint32_t Key(Type d)
+            {
+                uint32_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                return ~bits;       // non negative floats order as their bits
+            }
+
+#if defined(D3_SIMD_X86)
+            static int PassSSE2(const Type* depth, __m128 zLo, __m128 zHi)
+            {
+                __m128 ddLo = _mm_max_ps(zLo, _mm_setzero_ps());
+                __m128 ddHi = _mm_max_ps(zHi, _mm_setzero_ps());
+                return _mm_movemask_ps(_mm_cmpgt_ps(ddLo, _mm_loadu_ps(depth))) |
+                       _mm_movemask_ps(_mm_cmpgt_ps(ddHi, _mm_loadu_ps(depth + 4))) << 4;
+            }
+
+            D3_TARGET_AVX2 static __m256i TestAVX2(Type* depth, int, __m256 z, __m256i mask, __m256i& keys)
+            {
+                __m256  dd   = _mm256_max_ps(z, _mm256_setzero_ps());
+                __m256  dep  = _mm256_maskload_ps(depth, mask);
+                __m256i pass = _mm256_and_si256(mask, _mm256_castps_si256(_mm256_cmp_ps(dd, dep, _CMP_GT_OQ)));
+                if(!_mm256_testz_si256(pass, pass))
+                    _mm256_maskstore_ps(depth, pass, dd);
+                keys = _mm256_xor_si256(_mm256_castps_si256(dd), _mm256_set1_epi32(-1));
+                return pass;
+            }
+
+            static __m128i KeysSSE2(const Type* depth)
+            {
+                return _mm_xor_si128(_mm_loadu_si128((const __m128i*)depth), _mm_set1_epi32(-1));
+            }
+            D3_TARGET_AVX2 static __m256i KeysAVX2(const Type* depth)
+            {
+                return _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)depth), _mm256_set1_epi32(-1));
+            }
+#endif
+        };
+
+        // depth & image point at the row's first pixel, image is null for depth only
+        template<class Format>
+        using RowFunc = void (*)(const Row& row, int count, typename Format::Type* depth, uint32_t* image, const Texture& texture, Counters& counters);
+
+        // one covered pixel, shared by the scalar kernel and the SSE2 lane stores
+        template<class Format>
+        inline void Shade(typename Format::Type dd, float u, float v, typename Format::Type& depth, uint32_t* image, const Texture& texture, Counters& counters)
+        {
+            if(Format::Nearer(dd, depth))
+            {
+                uint32_t key = Format::Key(dd);
+                if(counters.min > key) counters.min = key;
+                if(counters.max < key) counters.max = key;
+                counters.written++;
+                depth = dd;
+                int iu = int(u);
+                int iv = int(v);
+                if(image && (uint32_t(iu) < uint32_t(texture.width)) && (uint32_t(iv) < uint32_t(texture.height)))
+                {
+                    *image = texture.texels[TexelIndex(texture, iu, iv)];
+                    counters.texels++;
+                }
+            }
+        }
+
+        struct Lanes    // per lane depth offsets: step * lane
+        {
+            float   z[Span];
+
+            Lanes(const Row& row)
+            {
+                for (int k = 0; k < Span; k++)
+                {
+                    z[k] = row.dz * float(k);
+                }
+            }
+        };
+
+        struct Texels   // texel coordinates of the current span: lane k samples u + du * k
+        {
+            float   u, du;
+            float   v, dv;
+            float   pu = 0;         // perspective: u/w, v/w & 1/w at the end of the span,
+            float   pv = 0;         // left 0 on the affine path
+            float   pq = 0;
+
+            Texels(const Row& row)
+            {
+                if(row.perspective)
+                {
+                    pu = row.u;
+                    pv = row.v;
+                    pq = row.q;
+                    u = pu / pq;
+                    v = pv / pq;
+                    Step(row);
+                }
+                else
+                {
+                    u = row.u;
+                    v = row.v;
+                    du = row.du;
+                    dv = row.dv;
+                }
+            }
+
+            // divide out the exact texel at the end of the span, step linearly up to it
+            void Step(const Row& row)
+            {
+                pu += row.du * float(Span);
+                pv += row.dv * float(Span);
+                pq += row.dq * float(Span);
+                du = (pu / pq - u) * (1.0f / Span);
+                dv = (pv / pq - v) * (1.0f / Span);
+            }
+
+            void Next(const Row& row)
+            {
+                if(row.perspective)
+                {
+                    u = pu / pq;
+                    v = pv / pq;
+                    Step(row);
+                }
+                else
+                {
+                    u += row.du * float(Span);
+                    v += row.dv * float(Span);
+                }
+            }
+        };
+
+        template<class Format>
+        inline void RowScalar(const Row& row, int count, typename Format::Type* depth, uint32_t* image, const Texture& texture, Counters& counters)
+        {
+            Lanes lanes(row);
+            Texels t(row);
+            int64_t e0 = row.e[0], e1 = row.e[1], e2 = row.e[2];
+            float z = row.z;
+
+            for (int x = 0; x < count; x += Span)
+            {
+                int n = std::min(Span, count - x);
+                for (int k = 0; k < n; k++)
+                {
+                    if((e0 | e1 | e2) >= 0)
+                    {
+                        Shade<Format>(Format::Encode(z + lanes.z[k]), t.u + t.du * float(k), t.v + t.dv * float(k), depth[x + k], image ? image + x + k : nullptr, texture, counters);
+                        counters.pixels++;
+                    }
+                    e0 += row.de[0];
+                    e1 += row.de[1];
+                    e2 += row.de[2];
+                }
+                z += row.dz * float(Span);
+                t.Next(row);
+            }
+        }
+
+        // RowScalar's coverage & depth test, image counts the pixel's visits instead of taking a texel
+        template<class Format>
+        inline void RowOverdraw(const Row& row, int count, typename Format::Type* depth, uint32_t* image, const Texture& texture, Counters& counters)
+        {
+            Lanes lanes(row);
+            int64_t e0 = row.e[0], e1 = row.e[1], e2 = row.e[2];
+            float z = row.z;
+
+            for (int x = 0; x < count; x += Span)
+            {
+                int n = std::min(Span, count - x);
+                for (int k = 0; k < n; k++)
+                {
+                    if((e0 | e1 | e2) >= 0)
+                    {
+                        Shade<Format>(Format::Encode(z + lanes.z[k]), 0, 0, depth[x + k], nullptr, texture, counters);
+                        counters.pixels++;
+                        if(image)
+                            image[x + k]++;
+                    }
+                    e0 += row.de[0];
+                    e1 += row.de[1];
+                    e2 += row.de[2];
+                }
+                z += row.dz * float(Span);
+            }
+        }
+
+#if defined(D3_SIMD_X86)
+        // SSE2 has no 64 bit compare, gather or masked store: the coverage and depth are
+        // computed 4 lanes at a time, the passing lanes are then stored one by one
+        template<class Format>
+        inline void RowSSE2(const Row& row, int count, typename Format::Type* depth, uint32_t* image, const Texture& texture, Counters& counters)
+        {
+            Lanes lanes(row);
+            __m128i e[3][Span / 2];
+            __m128i de[3];
+            for (int i = 0; i < 3; i++)
+            {
+                for (int k = 0; k < Span / 2; k++)
+                {
+                    e[i][k] = _mm_set_epi64x(row.e[i] + row.de[i] * (2 * k + 1), row.e[i] + row.de[i] * (2 * k));
+                }
+                de[i] = _mm_set1_epi64x(row.de[i] * Span);
+            }
+            const __m128  zLo = _mm_loadu_ps(lanes.z), zHi = _mm_loadu_ps(lanes.z + 4);
+            Texels t(row);
+            float z = row.z;
+
+            for (int x = 0; x < count; x += Span)
+            {
+                int cover = 0;
+                for (int k = 0; k < Span / 2; k++)
+                {
+                    __m128i o = _mm_or_si128(_mm_or_si128(e[0][k], e[1][k]), e[2][k]);
+                    cover |= _mm_movemask_pd(_mm_castsi128_pd(o)) << (2 * k);
+                    e[0][k] = _mm_add_epi64(e[0][k], de[0]);
+                    e[1][k] = _mm_add_epi64(e[1][k], de[1]);
+                    e[2][k] = _mm_add_epi64(e[2][k], de[2]);
+                }
+                cover = ~cover & 0xff;
+                int n = count - x;
+                if(n < Span)
+                    cover &= (1 << n) - 1;
+
+                if(cover)
+                {
+                    counters.pixels += BitCount(cover);
+                    if(n >= Span)
+                    {
+                        // all 8 depths are inside the row: test them together, skip the span if none pass
+                        __m128 vz = _mm_set1_ps(z);
+                        cover &= Format::PassSSE2(depth + x, _mm_add_ps(vz, zLo), _mm_add_ps(vz, zHi));
+                    }
+                    for (int bits = cover; bits; bits &= bits - 1)
+                    {
+                        int k = 0;
+                        while (!(bits & (1 << k))) k++;
+                        Shade<Format>(Format::Encode(z + lanes.z[k]), t.u + t.du * float(k), t.v + t.dv * float(k), depth[x + k], image ? image + x + k : nullptr, texture, counters);
+                    }
+                }
+                z += row.dz * float(Span);
+                t.Next(row);
+            }
+        }
+
+        template<class Format>
+        D3_TARGET_AVX2 inline void RowAVX2(const Row& row, int count, typename Format::Type* depth, uint32_t* image, const Texture& texture, Counters& counters)
+        {
+            Lanes lanes(row);
+            __m256i eLo[3], eHi[3], de[3];
+            for (int i = 0; i < 3; i++)
+            {
+                int64_t e = row.e[i], d = row.de[i];
+                eLo[i] = _mm256_setr_epi64x(e,         e + d,     e + 2 * d, e + 3 * d);
+                eHi[i] = _mm256_setr_epi64x(e + 4 * d, e + 5 * d, e + 6 * d, e + 7 * d);
+                de[i]  = _mm256_set1_epi64x(d * Span);
+            }
+            const __m256i bit   = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+            const __m256i sign  = _mm256_set1_epi32(int(0x80000000));
+            const __m256  lane  = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256  zLane = _mm256_loadu_ps(lanes.z);
+            const __m256i width = _mm256_set1_epi32(texture.width);
+            const __m256i tilesX = _mm256_set1_epi32(texture.tilesX);
+            const __m256i tileMask = _mm256_set1_epi32(TileMask);
+            const __m256i uMax  = _mm256_xor_si256(width, sign);
+            const __m256i vMax  = _mm256_xor_si256(_mm256_set1_epi32(texture.height), sign);
+            __m256i vmin = _mm256_set1_epi32(-1);
+            __m256i vmax = _mm256_setzero_si256();
+            Texels t(row);
+            float z = row.z;
+
+            for (int x = 0; x < count; x += Span)
+            {
+                __m256i oLo = _mm256_or_si256(_mm256_or_si256(eLo[0], eLo[1]), eLo[2]);
+                __m256i oHi = _mm256_or_si256(_mm256_or_si256(eHi[0], eHi[1]), eHi[2]);
+                int cover = ~(_mm256_movemask_pd(_mm256_castsi256_pd(oLo)) | (_mm256_movemask_pd(_mm256_castsi256_pd(oHi)) << 4)) & 0xff;
+                int n = count - x;
+                if(n < Span)
+                    cover &= (1 << n) - 1;
+
+                if(cover)
+                {
+                    counters.pixels += BitCount(cover);
+                    __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(cover), bit), bit);
+                    __m256i keys;
+                    __m256i pass = Format::TestAVX2(depth + x, n, _mm256_add_ps(_mm256_set1_ps(z), zLane), mask, keys);
+                    if(!_mm256_testz_si256(pass, pass))
+                    {
+                        counters.written += BitCount(_mm256_movemask_ps(_mm256_castsi256_ps(pass)));
+                        vmin = _mm256_min_epu32(vmin, _mm256_or_si256(keys, _mm256_andnot_si256(pass, _mm256_set1_epi32(-1))));
+                        vmax = _mm256_max_epu32(vmax, _mm256_and_si256(keys, pass));
+                        if(image)
+                        {
+                            __m256i iu = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_set1_ps(t.u), _mm256_mul_ps(_mm256_set1_ps(t.du), lane)));
+                            __m256i iv = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_set1_ps(t.v), _mm256_mul_ps(_mm256_set1_ps(t.dv), lane)));
+                            __m256i ok = _mm256_and_si256(pass, _mm256_and_si256(_mm256_cmpgt_epi32(uMax, _mm256_xor_si256(iu, sign)),
+                                                                                 _mm256_cmpgt_epi32(vMax, _mm256_xor_si256(iv, sign))));
+                            __m256i index;
+                            if(!texture.tilesX)
+                            {
+                                index = _mm256_add_epi32(iu, _mm256_mullo_epi32(iv, width));
+                            }
+                            else
+                            {
+                                __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(iv, TileShift), tilesX), _mm256_srli_epi32(iu, TileShift));
+                                index = _mm256_or_si256(_mm256_slli_epi32(tile, 2 * TileShift),
+                                                        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(iv, tileMask), TileShift), _mm256_and_si256(iu, tileMask)));
+                            }
+                            __m256i texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)texture.texels, index, ok, 4);
+                            _mm256_maskstore_epi32((int*)(image + x), ok, texel);
+                            counters.texels += BitCount(_mm256_movemask_ps(_mm256_castsi256_ps(ok)));
+                        }
+                    }
+                }
+                for (int i = 0; i < 3; i++)
+                {
+                    eLo[i] = _mm256_add_epi64(eLo[i], de[i]);
+                    eHi[i] = _mm256_add_epi64(eHi[i], de[i]);
+                }
+                z += row.dz * float(Span);
+                t.Next(row);
+            }
+
+            alignas(32) uint32_t mins[Span];
+            alignas(32) uint32_t maxs[Span];
+            _mm256_store_si256((__m256i*)mins, vmin);
+            _mm256_store_si256((__m256i*)maxs, vmax);
+            for (int k = 0; k < Span; k++)
+            {
+                if(counters.min > mins[k]) counters.min = mins[k];
+                if(counters.max < maxs[k]) counters.max = maxs[k];
+            }
+        }
+#endif
+
+        // maps the depth keys min..max to gray 0..255 with a multiply: the keys are shifted down
+        // until the range fits a float's mantissa, so every conversion is exact & every ISA agrees
+        struct Gray
+        {
+            uint32_t    min;
+            uint32_t    max;
+            int         shift;
+            float       scale;      // 255 / the shifted range
+
+            Gray(uint32_t min, uint32_t max) : min(min), max(max), shift(0)
+            {
+                uint32_t range = (max > min) ? max - min : 1;
+                while ((range >> shift) >= (1 << 24))
+                    shift++;
+                scale = 255.0f / float(range >> shift);
+            }
+
+            uint32_t operator () (uint32_t key) const
+            {
+                return (key <= max) ? uint32_t(int(float((key - min) >> shift) * scale)) * 0x010101 : 0xffffffff;
+            }
+        };
+
+        template<class Format>
+        using GrayFunc = void (*)(const typename Format::Type* depth, int count, uint32_t* pixels, const Gray& gray);
+
+        template<class Format>
+        inline void GrayScalar(const typename Format::Type* depth, int count, uint32_t* pixels, const Gray& gray)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                pixels[i] = gray(Format::Key(depth[i]));
+            }
+        }
+
+#if defined(D3_SIMD_X86)
+        template<class Format>
+        inline void GraySSE2(const typename Format::Type* depth, int count, uint32_t* pixels, const Gray& gray)
+        {
+            const __m128i sign  = _mm_set1_epi32(int(0x80000000));
+            const __m128i min   = _mm_set1_epi32(int(gray.min));
+            const __m128i max   = _mm_xor_si128(_mm_set1_epi32(int(gray.max)), sign);
+            const __m128i shift = _mm_cvtsi32_si128(gray.shift);
+            const __m128  scale = _mm_set1_ps(gray.scale);
+            int i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128i key  = Format::KeysSSE2(depth + i);
+                __m128i far  = _mm_cmpgt_epi32(_mm_xor_si128(key, sign), max);
+                __m128i g    = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srl_epi32(_mm_sub_epi32(key, min), shift)), scale));
+                // SSE2 has no 32 bit multiply: times 0x010101 is the byte copied into the next two
+                g = _mm_or_si128(g, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(g, 16)));
+                _mm_storeu_si128((__m128i*)(pixels + i), _mm_or_si128(g, far));
+            }
+            GrayScalar<Format>(depth + i, count - i, pixels + i, gray);
+        }
+
+        template<class Format>
+        D3_TARGET_AVX2 inline void GrayAVX2(const typename Format::Type* depth, int count, uint32_t* pixels, const Gray& gray)
+        {
+            const __m256i min   = _mm256_set1_epi32(int(gray.min));
+            const __m256i max   = _mm256_set1_epi32(int(gray.max));
+            const __m128i shift = _mm_cvtsi32_si128(gray.shift);
+            const __m256i rgb   = _mm256_set1_epi32(0x010101);
+            const __m256  scale = _mm256_set1_ps(gray.scale);
+            int i = 0;
+            for (; i + Span <= count; i += Span)
+            {
+                __m256i key = Format::KeysAVX2(depth + i);
+                __m256i far = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(key, max), key), _mm256_set1_epi32(-1));
+                __m256i g   = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srl_epi32(_mm256_sub_epi32(key, min), shift)), scale));
+                _mm256_storeu_si256((__m256i*)(pixels + i), _mm256_or_si256(_mm256_mullo_epi32(g, rgb), far));
+            }
+            GrayScalar<Format>(depth + i, count - i, pixels + i, gray);
+        }
+#endif
+
+        // visit counts to colours, in place: none black, then blue, cyan, green, yellow, red & white from 8 on
+        inline void HeatMap(uint32_t* pixels, int count)
+        {
+            static const uint32_t s_heat[] = { 0x000000, 0x000080, 0x0000ff, 0x00ffff, 0x00ff00, 0xffff00, 0xff8000, 0xff0000, 0xffffff };
+            const uint32_t last = sizeof(s_heat) / sizeof(s_heat[0]) - 1;
+            for (int i = 0; i < count; i++)
+            {
+                pixels[i] = s_heat[std::min(pixels[i], last)];
+            }
+        }
+
+        template<class Format>
+        inline GrayFunc<Format> SelectGray()
+        {
+            switch(Simd::ActiveIsa())
+            {
+#if defined(D3_SIMD_X86)
+            case Simd::Isa::AVX2: return GrayAVX2<Format>;
+            case Simd::Isa::AVX:
+            case Simd::Isa::SSE:  return GraySSE2<Format>;
+#endif
+            default:              return GrayScalar<Format>;
+            }
+        }
+
+        template<class Format>
+        inline RowFunc<Format> SelectRow()
+        {
+            switch(Simd::ActiveIsa())
+            {
+#if defined(D3_SIMD_X86)
+            case Simd::Isa::AVX2: return RowAVX2<Format>;
+            case Simd::Isa::AVX:
+            case Simd::Isa::SSE:  return RowSSE2<Format>;
+#endif
+            default:              return RowScalar<Format>;
+            }
+        }
+    }
+};  // namespace D3
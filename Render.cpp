@@ -1,41 +1,47 @@
-#include <windows.h>
+#include <limits.h>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <chrono>
 #include <map>
 
 #include "D3.h"
 #include "Render.h"
 #include "D3_app.h"
+#include "Workers.h"
+#include "Raster.h"
+#include "Framebuffer.h"
+#include "Bitmap.h"
+#include "Profile.h"
 
 using namespace D3;
 
-World CreateWorld(Model& model, float angle, float scale, float offset)
+void CreateWorld(World& world, const Model& model, float angle, float scale, float offset)
 {
-    Model modelX = model  * Scale(scale, scale, scale);
-    Model modelY = modelX * RotateZ(90);
-    Model modelZ = modelX * RotateY(90);
+    Matrix modelX = Scale(scale, scale, scale);
+    Matrix modelY = modelX * RotateZ(90);
+    Matrix modelZ = modelX * RotateY(90);
 
-    World world = modelX * (RotateX(angle) *                              Translate(-offset, -offset, -20));
-    world += modelY * (RotateY(angle) *                                   Translate(-offset,  offset, -40));
-    world += modelZ * (RotateZ(angle) *                                   Translate( offset, -offset, -60));
-    world += modelX * (RotateX(angle) * RotateY(angle) * RotateZ(angle) * Translate( offset,  offset,   0));
-
-    return world;
+    world.Clear();
+    world.Add(model, modelX * (RotateX(angle) *                              Translate(-offset, -offset, -20)));
+    world.Add(model, modelY * (RotateY(angle) *                              Translate(-offset,  offset, -40)));
+    world.Add(model, modelZ * (RotateZ(angle) *                              Translate( offset, -offset, -60)));
+    world.Add(model, modelX * (RotateX(angle) * RotateY(angle) * RotateZ(angle) * Translate( offset,  offset,   0)));
 }
 
 PModel MakeUp()
 {
     return std::make_shared<Model>(Model({
-                { { { -1, -1,  1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_UP, { {    0,    0 }, {    0,  179 }, {  179,  179 } } },
-                { { {  1,  1,  1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_UP, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
+                { { { -1, -1,  1 }, {  1,  1,  1 }, { -1,  1,  1 } }, ID_UP, { {    0,    0 }, {  179,  179 }, {    0,  179 } } },
+                { { {  1,  1,  1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_UP, { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
                 { { { -1, -1, -1 }, { -1,  1, -1 }, {  1,  1, -1 } }, ID_UP, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { {  1,  1, -1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_UP, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
                 { { { -1,  1, -1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_UP, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { {  1,  1,  1 }, {  1,  1, -1 }, { -1,  1, -1 } }, ID_UP, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
-                { { { -1, -1, -1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_UP, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1, -1,  1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_UP, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
-                { { {  1, -1, -1 }, {  1, -1,  1 }, {  1,  1,  1 } }, ID_UP, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1,  1,  1 }, {  1,  1, -1 }, {  1, -1, -1 } }, ID_UP, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
+                { { { -1, -1, -1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_UP, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1, -1,  1 }, { -1, -1, -1 }, {  1, -1, -1 } }, ID_UP, { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
+                { { {  1, -1, -1 }, {  1,  1,  1 }, {  1, -1,  1 } }, ID_UP, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1,  1,  1 }, {  1, -1, -1 }, {  1,  1, -1 } }, ID_UP, { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
                 { { { -1, -1, -1 }, { -1, -1,  1 }, { -1,  1,  1 } }, ID_UP, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { { -1,  1,  1 }, { -1,  1, -1 }, { -1, -1, -1 } }, ID_UP, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
             }));
@@ -44,16 +50,16 @@ PModel MakeUp()
 PModel MakeFrankie()
 {
     return std::make_shared<Model>(Model({
-                { { { -1, -1,  1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1,  1,  1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_FRANKIE, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
+                { { { -1, -1,  1 }, {  1,  1,  1 }, { -1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1,  1,  1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_FRANKIE, { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
                 { { { -1, -1, -1 }, { -1,  1, -1 }, {  1,  1, -1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { {  1,  1, -1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_FRANKIE, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
                 { { { -1,  1, -1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { {  1,  1,  1 }, {  1,  1, -1 }, { -1,  1, -1 } }, ID_FRANKIE, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
-                { { { -1, -1, -1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1, -1,  1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_FRANKIE, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
-                { { {  1, -1, -1 }, {  1, -1,  1 }, {  1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1,  1,  1 }, {  1,  1, -1 }, {  1, -1, -1 } }, ID_FRANKIE, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
+                { { { -1, -1, -1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_FRANKIE, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1, -1,  1 }, { -1, -1, -1 }, {  1, -1, -1 } }, ID_FRANKIE, { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
+                { { {  1, -1, -1 }, {  1,  1,  1 }, {  1, -1,  1 } }, ID_FRANKIE, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1,  1,  1 }, {  1, -1, -1 }, {  1,  1, -1 } }, ID_FRANKIE, { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
                 { { { -1, -1, -1 }, { -1, -1,  1 }, { -1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { { -1,  1,  1 }, { -1,  1, -1 }, { -1, -1, -1 } }, ID_FRANKIE, { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
         }));
@@ -62,16 +68,16 @@ PModel MakeFrankie()
 PModel MakeMixed()
 {
     return std::make_shared<Model>(Model({
-                { { { -1, -1,  1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1,  1,  1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_UP,      { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
+                { { { -1, -1,  1 }, {  1,  1,  1 }, { -1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1,  1,  1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_UP,      { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
                 { { { -1, -1, -1 }, { -1,  1, -1 }, {  1,  1, -1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { {  1,  1, -1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_UP,      { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
                 { { { -1,  1, -1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { {  1,  1,  1 }, {  1,  1, -1 }, { -1,  1, -1 } }, ID_UP,      { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
-                { { { -1, -1, -1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1, -1,  1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_UP,      { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
-                { { {  1, -1, -1 }, {  1, -1,  1 }, {  1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
-                { { {  1,  1,  1 }, {  1,  1, -1 }, {  1, -1, -1 } }, ID_UP,      { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
+                { { { -1, -1, -1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_FRANKIE, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1, -1,  1 }, { -1, -1, -1 }, {  1, -1, -1 } }, ID_UP,      { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
+                { { {  1, -1, -1 }, {  1,  1,  1 }, {  1, -1,  1 } }, ID_FRANKIE, { {    0,    0 }, {  179,  179 }, {    0, 179 } } },
+                { { {  1,  1,  1 }, {  1, -1, -1 }, {  1,  1, -1 } }, ID_UP,      { {  179,  179 }, {    0,    0 }, {  179,   0 } } },
                 { { { -1, -1, -1 }, { -1, -1,  1 }, { -1,  1,  1 } }, ID_FRANKIE, { {    0,    0 }, {    0, 179 }, {  179,  179 } } },
                 { { { -1,  1,  1 }, { -1,  1, -1 }, { -1, -1, -1 } }, ID_UP,      { {  179,  179 }, {  179,   0 }, {    0,    0 } } },
         }));
@@ -92,16 +98,16 @@ PModel MakeHalfempty()
 PModel MakeEarth()
 {
     return std::make_shared<Model>(Model({
-                { { {  1,  1,  1 }, { -1,  1,  1 }, { -1,  1, -1 } }, ID_EARTH, { { 200, 400 }, { 200, 600 }, { 400, 600 } } },
-                { { { -1,  1, -1 }, {  1,  1, -1 }, {  1,  1,  1 } }, ID_EARTH, { { 400, 600 }, { 400, 400 }, { 200, 400 } } },
-                { { { -1, -1,  1 }, { -1,  1,  1 }, {  1,  1,  1 } }, ID_EARTH, { {   0, 200 }, {   0, 400 }, { 200, 400 } } },
-                { { {  1,  1,  1 }, {  1, -1,  1 }, { -1, -1,  1 } }, ID_EARTH, { { 200, 400 }, { 200, 200 }, {   0, 200 } } },
-                { { {  1, -1, -1 }, {  1, -1,  1 }, {  1,  1,  1 } }, ID_EARTH, { { 400, 200 }, { 200, 200 }, { 200, 400 } } },
-                { { {  1,  1,  1 }, {  1,  1, -1 }, {  1, -1, -1 } }, ID_EARTH, { { 200, 400 }, { 400, 400 }, { 400, 200 } } },
+                { { {  1,  1,  1 }, { -1,  1, -1 }, { -1,  1,  1 } }, ID_EARTH, { { 200, 400 }, { 400, 600 }, { 200, 600 } } },
+                { { { -1,  1, -1 }, {  1,  1,  1 }, {  1,  1, -1 } }, ID_EARTH, { { 400, 600 }, { 200, 400 }, { 400, 400 } } },
+                { { { -1, -1,  1 }, {  1,  1,  1 }, { -1,  1,  1 } }, ID_EARTH, { {   0, 200 }, { 200, 400 }, {   0, 400 } } },
+                { { {  1,  1,  1 }, { -1, -1,  1 }, {  1, -1,  1 } }, ID_EARTH, { { 200, 400 }, {   0, 200 }, { 200, 200 } } },
+                { { {  1, -1, -1 }, {  1,  1,  1 }, {  1, -1,  1 } }, ID_EARTH, { { 400, 200 }, { 200, 400 }, { 200, 200 } } },
+                { { {  1,  1,  1 }, {  1, -1, -1 }, {  1,  1, -1 } }, ID_EARTH, { { 200, 400 }, { 400, 200 }, { 400, 400 } } },
                 { { {  1, -1, -1 }, { -1,  1, -1 }, {  1,  1, -1 } }, ID_EARTH, { { 400, 200 }, { 600, 400 }, { 400, 400 } } },
-                { { { -1,  1, -1 }, { -1, -1, -1 }, {  1, -1, -1 } }, ID_EARTH, { { 600, 400 }, { 600, 200 }, { 400, 200 } } },
-                { { { -1, -1,  1 }, {  1, -1,  1 }, {  1, -1, -1 } }, ID_EARTH, { { 200,   0 }, { 200, 200 }, { 400, 200 } } },
-                { { {  1, -1, -1 }, { -1, -1, -1 }, { -1, -1,  1 } }, ID_EARTH, { { 400, 200 }, { 400,   0 }, { 200,   0 } } },
+                { { { -1,  1, -1 }, {  1, -1, -1 }, { -1, -1, -1 } }, ID_EARTH, { { 600, 400 }, { 400, 200 }, { 600, 200 } } },
+                { { { -1, -1,  1 }, {  1, -1, -1 }, {  1, -1,  1 } }, ID_EARTH, { { 200,   0 }, { 400, 200 }, { 200, 200 } } },
+                { { {  1, -1, -1 }, { -1, -1,  1 }, { -1, -1, -1 } }, ID_EARTH, { { 400, 200 }, { 200,   0 }, { 400,   0 } } },
                 { { { -1, -1, -1 }, { -1, -1,  1 }, { -1,  1,  1 } }, ID_EARTH, { { 600, 200 }, { 800, 200 }, { 800, 400 } } },
                 { { { -1,  1,  1 }, { -1,  1, -1 }, { -1, -1, -1 } }, ID_EARTH, { { 800, 400 }, { 600, 400 }, { 600, 200 } } },
         }));
@@ -137,323 +143,899 @@ PModel GetModel(Options::Model model)
     case Options::Earth:     ret = MakeEarth();     break;
     case Options::Grid:      ret = MakeGrid();      break;
     }
+    ret->ResolveSurfaces([](uint id) { return (id <= ID_SURFACES_LAST) ? id - ID_SURFACES : 0; });
     s_mapModels[model] = ret;
     return ret;
 }
 
+// open models show their inside, only closed ones can drop their back faces
+bool IsClosed(Options::Model model)
+{
+    return (model != Options::Halfempty) && (model != Options::Grid);
+}
+
 class Render : public IRender
 {
     friend IRender;
 
-    HWND    m_hWnd    = nullptr;
+    using Clock = std::chrono::steady_clock;
+
     float   m_angle   = {};
     Rect    m_rect    = {};
     uint64_t m_nPixels= {};
-    uint    m_size    = {};
+    uint64_t m_nWritten = {};   // of m_nPixels, the ones that passed the depth test
+    uint64_t m_nTexels = {};    // fetched for m_nWritten
+    uint64_t m_nAllocs= {};     // at the start of the last frame
+    uint64_t m_nFrameAllocs = {};
+    uint    m_nCulled = {};     // triangles culled in the last frame
+    uint    m_nRasterized = {}; // triangles set up & binned in the last frame
+    uint64_t m_nCleared = {};   // bytes cleared in the last frame
     uint    m_nFrames = {};
-    uint    m_nStart  = {};
+    Clock::time_point m_start = Clock::now();
     Options m_options = {};
 
-    using PQuad = std::shared_ptr<RGBQUAD[]>;
-    PQuad   m_image;
+    using PTexels = std::shared_ptr<uint32_t[]>;
 
-    using PUint = std::shared_ptr<uint[]>;
-    PUint   m_depth;
+    // image planes drawn into in rotation (eg. triple buffered), each with its own stale tiles
+    static const int Images = 3;
+    struct ImagePlane
+    {
+        uint32_t*   pixels = nullptr;
+        uint        width  = 0;
+        uint        height = 0;
+        uint64_t    used   = 0;     // m_nDraws when last drawn into, the oldest is replaced
+    };
+    ImagePlane  m_images[Images];
+    int         m_slot   = 0;       // of the image plane being drawn into
+    uint64_t    m_nDraws = 0;
+    std::vector<uint> m_depth;  // the depth buffer in the m_options.depth format, sized for the widest
 
-    struct SurfaceInfo
+    struct Level
     {
-        PQuad   surface;
+        PTexels texels;     // row major
+        PTexels tiled;      // the same in Raster::Tile() order
         int     width;
         int     height;
     };
+    struct Surface      // indexed by Polygon::surface, all loaded up front
+    {
+        std::vector<Level> levels;  // mip chain: as loaded, then halved down to 1x1
+    };
+
+    using Surfaces = std::vector<Surface>;
+    Surfaces    m_surfaces;
+
+    // the geometry stage: world, sort, transform & cull of a frame into a slot of its own, so
+    // with Options::pipelined the next frame's runs on m_stage while this one rasterizes
+    static const int Geometries = 2;    // frames in flight
+    struct Geometry
+    {
+        Render*     render = nullptr;
+        Options     options;            // the inputs, copied by Draw()
+        Rect        rect;
+        Point       eye;
+        float       angle = 0;
+        World       world;              // reused every frame, so steady state frames don't allocate
+        Screen      screen;
+        uint        culled = 0;
+        int64_t     spans[Profile::Stages][2];  // start & end on m_profiler's clock, end 0 when not run
+
+        void operator()() { render->BuildGeometry(*this); }
+    };
+    Geometry    m_geometry[Geometries];
+    uint64_t    m_nGeometry = 0;        // slots filled
+    Geometry*   m_pending = nullptr;    // posted by the last pipelined Draw(), rasterized by the next
+    uint64_t    m_pendingTicket = 0;
+    uint        m_nTriangles = {};      // in the screen rasterized last
+    PolyPoly m_polyPoly;
+
+    struct Plane        // attribute = a + dx * x + dy * y, at pixel centres
+    {
+        float   a;
+        float   dx;
+        float   dy;
+
+        float At(float x, float y) const { return a + dx * x + dy * y; }
+    };
+
+    static const int SubPixel = 8;  // fixed point fraction bits of the edge functions
+    static constexpr float NearPlane = 1;
+    static constexpr float FarPlane  = 100;
+    static_assert(Raster::ScreenZMax == 100 * FarPlane / (FarPlane - NearPlane), "DepthUnorm16 spans the screen z these planes give");
+
+    struct Triangle     // a screen polygon set up once for every tile it touches
+    {
+        int64_t         a[3];       // edge e = a * x + b * y + c, x & y in fixed point,
+        int64_t         b[3];       // >= 0 inside (c carries the top-left fill rule)
+        int64_t         c[3];
+        Plane           z;          // screen z, or near / w for Raster::DepthFloat
+        Plane           sx;         // sx/w & sy/w when perspective correct
+        Plane           sy;
+        Plane           q;          // 1/w
+        int             x0, y0;     // bounding box, inclusive, clipped to the window
+        int             x1, y1;
+        uint            zMin;       // depth key, conservative: no pixel is nearer
+        const uint32_t* surface;
+        int             sWidth;
+        int             sHeight;
+    };
+    using Triangles = std::vector<Triangle>;
+    Triangles m_triangles;
+    float     m_zLo    = 0;     // DepthUnorm16: the frame's screen z range, stretched over the 16 bits
+    float     m_zScale = 1;
 
-    using MapSurfaces = std::map<uint, SurfaceInfo>;
-    MapSurfaces s_mapSurfaces;
+    static const int TileSize = 64;
+    static const int HiZSize  = 8;  // pixels per side of a hierarchical Z block
+    static const int HiZBlocks = TileSize / HiZSize;
+    struct Tile         // sort-middle bin: the triangles touching rect, in submission order
+    {
+        Rect                rect;
+        std::vector<uint>   triangles;
+        uint                zMax;   // hierarchical Z: no depth key in the tile is farther
+        uint                zBlocks[HiZBlocks][HiZBlocks];  // the same per block, 0 outside rect
+        bool                staleDepth = true;  // pixels left by an earlier frame, cleared
+        bool                staleImage[Images] = { true, true, true };  // only when the tile is next visited
+    };
+    using Tiles = std::vector<Tile>;
+    Tiles   m_tiles;
+    Rect    m_tilesRect = {};
+    int     m_tilesX  = {};
 
-    Render(HWND hWnd) : m_hWnd(hWnd), m_nStart(GetTickCount()) { ::SetTimer(m_hWnd, (UINT_PTR)this, 1, TimerProc); }
-    static void CALLBACK TimerProc(HWND hwnd, UINT uMsg, UINT_PTR event, DWORD dwTime) { ((IRender*)event)->Timer(); }
-    virtual void Timer() { m_angle += 1; InvalidateRect(m_hWnd, nullptr, false); }
-    virtual void Draw(HDC hdcScreen, Options& options, Point& eye);
+    struct Counters : Raster::Counters  // per thread, merged after the tiles are done
+    {
+        uint64_t    cleared;                // bytes of stale tiles cleared
+    };
+    std::vector<Counters> m_counters;
+    Workers m_workers;
+    Profile::Profiler m_profiler;
+    StageQueue<Geometries> m_stage;     // last, its jobs use the members above
+
+    Render(const Options& options)
+    {
+        for (Geometry& geometry : m_geometry)
+        {
+            geometry.render = this;
+        }
+        LoadSurfaces(options.surfaces);
+    }
+    virtual void Timer() { m_angle += 1; }
+    virtual Framebuffer::Plane Draw(Framebuffer& frame, const Options& options, const Point& eye);
+    virtual void Overdrawn(Framebuffer& frame, const Rect& rect) { StaleTiles(rect, false, FindImage(frame)); }
+    virtual Stats GetStats() const;
+    virtual Profile::Profiler& Profiler() { return m_profiler; }
 private:
-    PQuad   GetSurface(uint id, int& height, int& width);
-    void    RenderWireFrame(Mesh& mesh, HDC hDepth);
-    void    RenderBitmaps(const Mesh& mesh, uint* depth, RGBQUAD* image, uint& min, uint& max);
-    void    GrayScale(uint* depth, uint size, uint min, uint max);
-    void    DrawStats(HDC hdc, COLORREF color, Point& eye, bool doMPixels);
+    void    LoadSurfaces(const char** files);
+    void    BuildGeometry(Geometry& geometry) const;
+    void    RenderWireFrame(Mesh& mesh, uint32_t* image);
+    void    RenderBitmaps(const Mesh& mesh, uint32_t* image, uint* gray);
+    bool    SetupTriangle(const D3::Polygon& polygon, Triangle& triangle);
+    void    BinTriangles(const Mesh& mesh);
+    void    StaleTiles(const Rect& rect, bool depth, int image);
+    int     FindImage(Framebuffer& frame);
+    int     AdoptImage(Framebuffer& frame);
+
+    // templated on the depth format, RenderBitmaps() picks the instance
+    template<class Format>
+    void    RenderTiles(uint32_t* image, uint& min, uint& max);
+    template<class Format>
+    void    ClearTile(Tile& tile, typename Format::Type* depth, uint32_t* image, Counters& counters);
+    template<class Format>
+    void    RasterizeTriangle(const Triangle& triangle, Tile& tile, Raster::RowFunc<Format> row,
+                              typename Format::Type* depth, uint32_t* image, Counters& counters);
+    template<class Format>
+    void    UpdateHiZ(Tile& tile, int by, int bx0, int bx1, const typename Format::Type* depth);
+    template<class Format>
+    void    GrayScale(uint* gray, uint min, uint max);
+    void    HeatMap(uint32_t* image);
 };
 
-IRender* IRender::Create(HWND hWnd)
+IRender* IRender::Create(const Options& options)
 {
-    return new Render(hWnd);
+    return new Render(options);
 }
 
-Render::PQuad Render::GetSurface(uint id, int& height, int& width)
+void Render::LoadSurfaces(const char** files)
 {
-    auto it = s_mapSurfaces.find(id);
-    if(it != s_mapSurfaces.end())
+    m_surfaces.resize(ID_SURFACES_LAST - ID_SURFACES + 1);
+    for (uint i = 0; i < m_surfaces.size(); i++)
     {
-        SurfaceInfo& info = it->second;
-        height = info.height;
-        width = info.width;
-        return info.surface;
+        std::vector<uint32_t> bitmap;
+        int width  = 1;
+        int height = 1;
+        if(!files || !ReadBitmap(files[i], bitmap, width, height))
+            bitmap.assign(1, 0x808080);     // missing: one gray texel, so the models still draw
+
+        PTexels texels(new uint32_t[bitmap.size()]);
+        std::copy(bitmap.begin(), bitmap.end(), texels.get());
+        std::vector<Level>& levels = m_surfaces[i].levels;
+        levels.clear();
+        for (;;)
+        {
+            PTexels tiled(new uint32_t[(Raster::TilesX(width) * Raster::TilesY(height)) << (2 * Raster::TileShift)]);
+            Raster::Tile(texels.get(), width, height, tiled.get());
+            levels.push_back({ texels, tiled, width, height });
+            if((width == 1) && (height == 1))
+                break;
+
+            int w = std::max(width / 2, 1);
+            int h = std::max(height / 2, 1);
+            PTexels next(new uint32_t[w * h]);
+            Raster::Downsample(texels.get(), width, height, next.get());
+            texels = next;
+            width  = w;
+            height = h;
+        }
     }
-    struct
-    {
-        BITMAPINFO bmi;
-        RGBQUAD rgb[2];
-    } info = { sizeof(BITMAPINFOHEADER) };
+}
 
-    HDC hdc = CreateCompatibleDC(nullptr);
-    HBITMAP hBmp = (HBITMAP)LoadImage(nullptr, m_options.surfaces[id - ID_SURFACES], IMAGE_BITMAP, 0, 0, LR_DEFAULTSIZE | LR_SHARED | LR_LOADFROMFILE);
-    int rc = GetDIBits(hdc, hBmp, 0, 0, nullptr, &info.bmi, BI_RGB);
-    PQuad surface(new RGBQUAD[info.bmi.bmiHeader.biSizeImage / sizeof(RGBQUAD)]);
+// the geometry stage, it touches nothing but geometry (and the profiler's clock), so it can
+// run on m_stage while Draw() rasterizes the frame before
+void Render::BuildGeometry(Geometry& geometry) const
+{
+    const Options& options = geometry.options;
+    const Point& eye = geometry.eye;
+    Point  from   = { eye.X(), eye.Y(), eye.Z() };
+    Point  target = { 0, 0, 0 };
+    Vector up     = { (float)sin(eye.W() / 180 * pi), (float)cos(eye.W() / 180 * pi), 0 };
 
-    rc = GetDIBits(hdc, hBmp, 0, info.bmi.bmiHeader.biHeight, surface.get(), &info.bmi, BI_RGB);
+    memset(geometry.spans, 0, sizeof(geometry.spans));
+    auto span = [&](Profile::Stage stage, int64_t start)
+    {
+        geometry.spans[stage][0] = start;
+        geometry.spans[stage][1] = std::max(m_profiler.Now(), start + 1);
+    };
 
-    s_mapSurfaces[id] = { surface, info.bmi.bmiHeader.biWidth, info.bmi.bmiHeader.biHeight };
+    int64_t start = m_profiler.Now();
+    PModel pModel = GetModel(options.model);
+    CreateWorld(geometry.world, *pModel, geometry.angle, options.scale, options.offset);
+    if(options.sort)
+        geometry.world.SortFrontToBack(PointOfView(from, target, up), NearPlane, FarPlane);
+    span(Profile::World, start);
 
-    DeleteObject(hBmp);
-    DeleteDC(hdc);
+    start = m_profiler.Now();
+    ScreenTrasnform(geometry.world, geometry.rect, from, target, up, 45, NearPlane, FarPlane, geometry.screen);
+    span(Profile::Transform, start);
 
-    return surface;
+    geometry.culled = 0;
+    if(options.cull && (options.mode != Options::Wireframe))
+    {
+        start = m_profiler.Now();
+        geometry.culled = geometry.screen.Cull(geometry.rect, IsClosed(options.model));
+        span(Profile::Cull, start);
+    }
 }
 
-void Render::RenderWireFrame(Mesh& mesh, HDC hDepth)
+void Render::RenderWireFrame(Mesh& mesh, uint32_t* image)
 {
-    PolyPoly polyPoly;
-    mesh.ExportPolyPoly(polyPoly);
-    polyPoly.Draw(hDepth);
+    m_polyPoly.Clear();
+    mesh.ExportPolyPoly(m_polyPoly);
+    m_polyPoly.Draw(image, m_rect, 0xffffff);
 }
 
-void Render::RenderBitmaps(const Mesh& mesh, uint* depth, RGBQUAD* image, uint& min, uint& max)
+void Render::BinTriangles(const Mesh& mesh)
 {
+    const Rect& rect = m_rect;
+    if((m_tilesRect != rect) || m_tiles.empty())
+    {
+        m_tilesRect = rect;
+        m_tilesX = (rect.Width() + TileSize - 1) / TileSize;
+        int tilesY = (rect.Height() + TileSize - 1) / TileSize;
+        m_tiles.resize(std::max(m_tilesX * tilesY, 1));
+        for (int ty = 0; ty < tilesY; ty++)
+        {
+            for (int tx = 0; tx < m_tilesX; tx++)
+            {
+                Tile& bin = m_tiles[tx + ty * m_tilesX];
+                Rect& tile = bin.rect;
+                tile.left   = rect.left + tx * TileSize;
+                tile.top    = rect.top  + ty * TileSize;
+                tile.right  = std::min(tile.left + TileSize, int(rect.right));
+                tile.bottom = std::min(tile.top  + TileSize, int(rect.bottom));
+                bin.staleDepth = true;
+                std::fill_n(bin.staleImage, Images, true);
+            }
+        }
+    }
+    for (Tile& tile : m_tiles)
+    {
+        tile.triangles.clear();
+
+        // the depth buffer is cleared to UINT_MAX before the tile is drawn
+        tile.zMax = UINT_MAX;
+        for (int by = 0; by < HiZBlocks; by++)
+        {
+            for (int bx = 0; bx < HiZBlocks; bx++)
+            {
+                bool inside = (tile.rect.left + bx * HiZSize < tile.rect.right) && (tile.rect.top + by * HiZSize < tile.rect.bottom);
+                tile.zBlocks[by][bx] = inside ? UINT_MAX : 0;
+            }
+        }
+    }
+
+    // 16 bits over the whole screen z range are too coarse where the projection squeezes the
+    // depths together, so they span what the frame uses; an affine map keeps the planes exact
+    if(m_options.depth == Options::Unorm16)
+    {
+        float lo, hi;
+        mesh.DepthRange(lo, hi);
+        m_zLo    = (lo < hi) ? lo : 0;
+        m_zScale = (lo < hi) ? Raster::ScreenZMax / (hi - lo) : 1;
+    }
+
     int count = mesh.Count();
+    m_triangles.resize(count);
+    m_nRasterized = 0;
     for (int i = 0; i < count; i++)
     {
-        D3::Polygon polygon = mesh[i];
+        Triangle& triangle = m_triangles[i];
+        if(!SetupTriangle(mesh[i], triangle))
+            continue;
+        m_nRasterized++;
+
+        for (int ty = (triangle.y0 - rect.top) / TileSize; ty <= (triangle.y1 - rect.top) / TileSize; ty++)
+        {
+            for (int tx = (triangle.x0 - rect.left) / TileSize; tx <= (triangle.x1 - rect.left) / TileSize; tx++)
+            {
+                m_tiles[tx + ty * m_tilesX].triangles.push_back(i);
+            }
+        }
+    }
+}
 
-        int sHeight = 0;
-        int sWidth = 0;
-        PQuad surface = GetSurface(polygon.id, sHeight, sWidth);
+// edge functions and attribute gradients are computed once here, the raster loop only adds
+bool Render::SetupTriangle(const D3::Polygon& polygon, Triangle& triangle)
+{
+    const float guard = float(1 << 22);   // keeps the fixed point products inside 64 bits
+    const Point* p[3] = { &polygon.tripple3.p0, &polygon.tripple3.p1, &polygon.tripple3.p2 };
+    const Point2* s[3] = { &polygon.tripple2.p0, &polygon.tripple2.p1, &polygon.tripple2.p2 };
+
+    int64_t x[3];
+    int64_t y[3];
+    for (int i = 0; i < 3; i++)
+    {
+        if(!((fabs(p[i]->X()) < guard) && (fabs(p[i]->Y()) < guard)))
+            return false;   // also rejects NaN
+        x[i] = int64_t(floor(p[i]->X() * (1 << SubPixel) + 0.5f));
+        y[i] = int64_t(floor(p[i]->Y() * (1 << SubPixel) + 0.5f));
+    }
 
-        Point& p0 = polygon.tripple3.p0;
-        Point& p1 = polygon.tripple3.p1;
-        Point& p2 = polygon.tripple3.p2;
+    int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+    if(area == 0)
+        return false;
+    if(area < 0)
+    {
+        std::swap(x[1], x[2]);
+        std::swap(y[1], y[2]);
+        std::swap(p[1], p[2]);
+        std::swap(s[1], s[2]);
+        area = -area;
+    }
 
-        Point2& s0 = polygon.tripple2.p0;
-        Point2& s1 = polygon.tripple2.p1;
-        Point2& s2 = polygon.tripple2.p2;
+    const Rect& rect = m_rect;
+    triangle.x0 = std::max(int(std::min(std::min(x[0], x[1]), x[2]) >> SubPixel), int(rect.left));
+    triangle.y0 = std::max(int(std::min(std::min(y[0], y[1]), y[2]) >> SubPixel), int(rect.top));
+    triangle.x1 = std::min(int(std::max(std::max(x[0], x[1]), x[2]) >> SubPixel), int(rect.right) - 1);
+    triangle.y1 = std::min(int(std::max(std::max(y[0], y[1]), y[2]) >> SubPixel), int(rect.bottom) - 1);
+    if((triangle.x0 > triangle.x1) || (triangle.y0 > triangle.y1))
+        return false;   // off screen
 
-        if(p0.Y() > p1.Y()) { std::swap(p0, p1); std::swap(s0, s1); }
-        if(p0.Y() > p2.Y()) { std::swap(p0, p2); std::swap(s0, s2); }
-        if(p1.Y() > p2.Y()) { std::swap(p1, p2); std::swap(s1, s2); }
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        int64_t a = y[i] - y[j];
+        int64_t b = x[j] - x[i];
+        bool topLeft = (a > 0) || ((a == 0) && (b > 0));
+        triangle.a[i] = a;
+        triangle.b[i] = b;
+        triangle.c[i] = x[i] * y[j] - y[i] * x[j] - (topLeft ? 0 : 1);
+    }
 
-        uint64_t& nPixels = m_nPixels;
-        auto Rasterize = [&, rect = m_rect, surface = surface.get()](Point& p0, Point& p1, Point& p2, Point& p3, Point2& s0, Point2& s1, Point2& s2, Point2& s3)
+    float fx1 = p[1]->X() - p[0]->X();
+    float fy1 = p[1]->Y() - p[0]->Y();
+    float fx2 = p[2]->X() - p[0]->X();
+    float fy2 = p[2]->Y() - p[0]->Y();
+    float inv = 1 / (fx1 * fy2 - fy1 * fx2);
+    auto MakePlane = [&](float a0, float a1, float a2)
+    {
+        Plane plane;
+        plane.dx = ((a1 - a0) * fy2 - (a2 - a0) * fy1) * inv;
+        plane.dy = ((a2 - a0) * fx1 - (a1 - a0) * fx2) * inv;
+        plane.a  = a0 - plane.dx * p[0]->X() - plane.dy * p[0]->Y();
+        return plane;
+    };
+    // mip level: log2 of texels per pixel, from the areas the triangle covers in the surface & on screen
+    const Surface& surface = m_surfaces[polygon.surface];
+    int level = 0;
+    if(m_options.mipmap)
+    {
+        float texels = fabs((s[1]->x - s[0]->x) * (s[2]->y - s[0]->y) - (s[1]->y - s[0]->y) * (s[2]->x - s[0]->x));
+        float pixels = float(area) / (1 << (2 * SubPixel));
+        float lod = 0.5f * log2(texels / pixels);
+        if(lod >= 1)
+            level = std::min(int(lod), int(surface.levels.size()) - 1);
+    }
+    const Level& mip = surface.levels[level];
+    const float  texel = 1.0f / (1 << level);
+
+    // pixel depths interpolate the vertex depths, the slack covers the plane's rounding
+    switch(m_options.depth)
+    {
+    default:
+    case Options::Fixed32:
+    {
+        triangle.z = MakePlane(p[0]->Z(), p[1]->Z(), p[2]->Z());
+        float zMin = std::max(std::min(std::min(p[0]->Z(), p[1]->Z()), p[2]->Z()) - 0.01f, 0.0f);
+        triangle.zMin = Raster::DepthFixed::Key(Raster::DepthFixed::Encode(zMin));
+        break;
+    }
+    case Options::Unorm16:
+    {
+        // in the frame's depth range, see BinTriangles()
+        float z[3];
+        for (int i = 0; i < 3; i++)
         {
-            int width = rect.Width();
-            int den0 = int(p2.Y() - p0.Y());
-            int den1 = int(p3.Y() - p1.Y());
-            for (int y = int(p0.Y()); y < int(p2.Y()); y++)
+            z[i] = std::max(p[i]->Z() - m_zLo, 0.0f) * m_zScale;
+        }
+        triangle.z = MakePlane(z[0], z[1], z[2]);
+        float zMin = std::max(std::min(std::min(z[0], z[1]), z[2]) - 0.01f * m_zScale, 0.0f);
+        triangle.zMin = Raster::DepthUnorm16::Key(Raster::DepthUnorm16::Encode(zMin));
+        break;
+    }
+    case Options::Float32:
+    {
+        // screen points keep 1/w, reversed Z is the nearest with the largest
+        triangle.z = MakePlane(NearPlane * p[0]->W(), NearPlane * p[1]->W(), NearPlane * p[2]->W());
+        float zMax = NearPlane * std::max(std::max(p[0]->W(), p[1]->W()), p[2]->W()) + 0.0001f;
+        triangle.zMin = Raster::DepthFloat::Key(Raster::DepthFloat::Encode(zMax));
+        break;
+    }
+    }
+    if(m_options.perspective)
+    {
+        // screen points keep 1/w, anything divided by w interpolates linearly on screen
+        triangle.q  = MakePlane(p[0]->W(), p[1]->W(), p[2]->W());
+        triangle.sx = MakePlane(s[0]->x * texel * p[0]->W(), s[1]->x * texel * p[1]->W(), s[2]->x * texel * p[2]->W());
+        triangle.sy = MakePlane(s[0]->y * texel * p[0]->W(), s[1]->y * texel * p[1]->W(), s[2]->y * texel * p[2]->W());
+    }
+    else
+    {
+        triangle.q  = { 1, 0, 0 };
+        triangle.sx = MakePlane(s[0]->x * texel, s[1]->x * texel, s[2]->x * texel);
+        triangle.sy = MakePlane(s[0]->y * texel, s[1]->y * texel, s[2]->y * texel);
+    }
+
+    triangle.surface = m_options.tiled ? mip.tiled.get() : mip.texels.get();
+    triangle.sWidth  = mip.width;
+    triangle.sHeight = mip.height;
+    return true;
+}
+
+// recomputes the blocks bx0..bx1 of block row by from the depth buffer, then the tile's max
+template<class Format>
+void Render::UpdateHiZ(Tile& tile, int by, int bx0, int bx1, const typename Format::Type* depth)
+{
+    const Rect& rect = tile.rect;
+    const int width = m_rect.Width();
+    int y0 = rect.top + by * HiZSize;
+    int y1 = std::min(y0 + HiZSize, int(rect.bottom));
+    for (int bx = bx0; bx <= bx1; bx++)
+    {
+        int x0 = rect.left + bx * HiZSize;
+        int x1 = std::min(x0 + HiZSize, int(rect.right));
+        uint zMax = 0;
+        for (int y = y0; y < y1; y++)
+        {
+            const typename Format::Type* row = depth + y * width;
+            for (int x = x0; x < x1; x++)
             {
-                if((y < rect.top) || (y >= rect.bottom)) continue;
-
-                int num0  = int(y - p0.Y());
-                int num1  = int(y - p1.Y());
-                int h0    = int(p0.X());
-                int h1    = int(p1.X());
-                float d0  = p0.Z();
-                float d1  = p1.Z();
-                float s0x = s0.x;
-                float s0y = s0.y;
-                float s1x = s1.x;
-                float s1y = s1.y;
-
-                if(den0 != 0)
-                {
-                    h0  += int((p2.X() - p0.X()) * num0 / den0);
-                    d0  +=    ((p2.Z() - p0.Z()) * num0 / den0);
-                    s0x +=    ((s2.x   - s0.x)   * num0 / den0);
-                    s0y +=    ((s2.y   - s0.y)   * num0 / den0);
-                }
-                if(den1 != 0)
-                {
-                    h1  += int((p3.X() - p1.X()) * num1 / den1);
-                    d1  +=    ((p3.Z() - p1.Z()) * num1 / den1);
-                    s1x +=    ((s3.x   - s1.x)   * num1 / den1);
-                    s1y +=    ((s3.y   - s1.y)   * num1 / den1);
-                }
-                if(h0 > h1)
-                {
-                    std::swap(h0,  h1);
-                    std::swap(d0,  d1);
-                    std::swap(s0x, s1x);
-                    std::swap(s0y, s1y);
-                }
-
-                int den = h1 - h0;
-                for (int x = h0; x < h1; x++)
-                {
-                    if((x < rect.left) || (x >= rect.right)) continue;
-
-                    int num  = x - h0;
-                    float d  = d0;
-                    float sx = s0x;
-                    float sy = s0y;
-
-                    if(den != 0)
-                    {
-                        d  += (d1  - d0)  * num / den;
-                        sx += (s1x - s0x) * num / den;
-                        sy += (s1y - s0y) * num / den;
-                    }
-
-                    uint dd = uint(d * 10000);
-                    uint ndex = x + y * width;
-                    uint& dep = depth[ndex];
-                    if(dd < dep)
-                    {
-                        if(min > dd) min = dd;
-                        if(max < dd) max = dd;
-                        dep = dd;
-                        if(image && (int(sy) < sHeight))
-                        {
-                            image[ndex] = surface[int(sx) + int(sy) * sWidth];
-                        }
-                    }
-                    nPixels++;
-                }
+                zMax = std::max(zMax, Format::Key(row[x]));
             }
-        };
+        }
+        tile.zBlocks[by][bx] = zMax;
+    }
 
-        Rasterize(p0, p0, p1, p2, s0, s0, s1, s2);
-        Rasterize(p1, p0, p2, p2, s1, s0, s2, s2);
+    uint zMax = 0;
+    for (int b = 0; b < HiZBlocks; b++)
+    {
+        for (int bx = 0; bx < HiZBlocks; bx++)
+        {
+            zMax = std::max(zMax, tile.zBlocks[b][bx]);
+        }
     }
+    tile.zMax = zMax;
 }
 
-void Render::GrayScale(uint* depth, uint size, uint min, uint max)
+template<class Format>
+void Render::RasterizeTriangle(const Triangle& triangle, Tile& tile, Raster::RowFunc<Format> row,
+                               typename Format::Type* depth, uint32_t* image, Counters& counters)
 {
-    int diff = max - min;
-    if(!diff)
+    const Rect& rect = tile.rect;
+    int x0 = std::max(triangle.x0, int(rect.left));
+    int y0 = std::max(triangle.y0, int(rect.top));
+    int x1 = std::min(triangle.x1, int(rect.right) - 1);
+    int y1 = std::min(triangle.y1, int(rect.bottom) - 1);
+    if((x0 > x1) || (y0 > y1))
         return;
 
-    for (uint* pixel = depth; pixel< depth + size; pixel++)
+    const int      width   = m_rect.Width();
+    const int64_t  half    = 1 << (SubPixel - 1);
+    Raster::Texture texture = { triangle.surface, triangle.sWidth, triangle.sHeight,
+                                m_options.tiled ? Raster::TilesX(triangle.sWidth) : 0 };
+
+    Raster::Row span;
+    int64_t edge[3];
+    for (int i = 0; i < 3; i++)
+    {
+        span.de[i] = triangle.a[i] << SubPixel;
+        edge[i]    = triangle.a[i] * ((int64_t(x0) << SubPixel) + half) +
+                     triangle.b[i] * ((int64_t(y0) << SubPixel) + half) + triangle.c[i];
+    }
+    span.dz = triangle.z.dx;
+    span.du = triangle.sx.dx;
+    span.dv = triangle.sy.dx;
+    span.dq = triangle.q.dx;
+    span.perspective = m_options.perspective;
+
+    // rows are walked in bands of hierarchical Z blocks, a band behind all its blocks is skipped
+    const int bx0 = (x0 - rect.left) / HiZSize;
+    const int bx1 = (x1 - rect.left) / HiZSize;
+    for (int y = y0; y <= y1; )
+    {
+        int by   = (y - rect.top) / HiZSize;
+        int yEnd = std::min(y1, int(rect.top) + (by + 1) * HiZSize - 1);
+        uint zMax = 0;
+        for (int bx = bx0; bx <= bx1; bx++)
+        {
+            zMax = std::max(zMax, tile.zBlocks[by][bx]);
+        }
+        if(triangle.zMin >= zMax)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                edge[i] += (triangle.b[i] << SubPixel) * (yEnd - y + 1);
+            }
+            y = yEnd + 1;
+            continue;
+        }
+
+        uint64_t pixels = counters.pixels;
+        for (; y <= yEnd; y++)
+        {
+            float cx = x0 + 0.5f;
+            float cy = y  + 0.5f;
+            span.z = triangle.z.At(cx, cy);
+            span.u = triangle.sx.At(cx, cy);
+            span.v = triangle.sy.At(cx, cy);
+            span.q = triangle.q.At(cx, cy);
+            for (int i = 0; i < 3; i++)
+            {
+                span.e[i] = edge[i];
+                edge[i] += triangle.b[i] << SubPixel;
+            }
+
+            uint ndex = x0 + y * width;
+            row(span, x1 - x0 + 1, depth + ndex, image ? image + ndex : nullptr, texture, counters);
+        }
+        if(counters.pixels != pixels)
+            UpdateHiZ<Format>(tile, by, bx0, bx1, depth);
+    }
+}
+
+// clears what earlier frames left in the tile, image only when one is drawn
+template<class Format>
+void Render::ClearTile(Tile& tile, typename Format::Type* depth, uint32_t* image, Counters& counters)
+{
+    const Rect& rect = tile.rect;
+    const int width = m_rect.Width();
+    if(tile.staleDepth)
+    {
+        for (int y = rect.top; y < rect.bottom; y++)
+        {
+            std::fill_n(depth + rect.left + y * width, rect.Width(), Format::Clear());
+        }
+        tile.staleDepth = false;
+        counters.cleared += rect.Width() * rect.Height() * sizeof(*depth);
+    }
+    if(image && tile.staleImage[m_slot])
+    {
+        for (int y = rect.top; y < rect.bottom; y++)
+        {
+            memset(image + rect.left + y * width, 0x00, rect.Width() * sizeof(*image));
+        }
+        tile.staleImage[m_slot] = false;
+        counters.cleared += rect.Width() * rect.Height() * sizeof(*image);
+    }
+}
+
+// marks the tiles overlapping rect as holding pixels that need clearing, in the depth buffer
+// and in the image plane of slot image (none when -1)
+void Render::StaleTiles(const Rect& rect, bool depth, int image)
+{
+    for (Tile& tile : m_tiles)
+    {
+        if((tile.rect.left < rect.right) && (rect.left < tile.rect.right) &&
+           (tile.rect.top < rect.bottom) && (rect.top < tile.rect.bottom))
+        {
+            tile.staleDepth = tile.staleDepth || depth;
+            if(image >= 0)
+                tile.staleImage[image] = true;
+        }
+    }
+}
+
+// the slot of the frame's image plane, -1 when it isn't one of the last Images drawn into
+int Render::FindImage(Framebuffer& frame)
+{
+    uint32_t* pixels = frame.Pixels(Framebuffer::Image);
+    for (int slot = 0; slot < Images; slot++)
     {
-        if(*pixel <= max)
-            *pixel = (*pixel - min) * 255 / diff * 0x010101;
+        const ImagePlane& plane = m_images[slot];
+        if((plane.pixels == pixels) && (plane.width == frame.Width()) && (plane.height == frame.Height()))
+            return slot;
     }
+    return -1;
 }
 
-void Render::DrawStats(HDC hdc, COLORREF color, Point& eye, bool doMPixels)
+// the slot to draw the frame's image plane with: its own, or the least recently used one,
+// all stale, for another or a reallocated plane
+int Render::AdoptImage(Framebuffer& frame)
 {
-    if(m_options.stats)
+    int slot = FindImage(frame);
+    if(slot < 0)
     {
-        m_nFrames++;
-        char sz[30] = {};
-        SetTextColor(hdc, color);
-        SetBkColor(hdc, 0xffffff - color);
-        if(!m_options.pause)
+        slot = 0;
+        for (int i = 1; i < Images; i++)
         {
-            int offset = 0;
-            uint delta = GetTickCount() - m_nStart + 1;
-            int len = sprintf(sz, "Frames/S = %f", double(m_nFrames) * 1000 / delta);
-            TextOut(hdc, 0, offset, sz, len);
-            offset += 20;
-            if(doMPixels)
+            if(m_images[i].used < m_images[slot].used)
+                slot = i;
+        }
+        m_images[slot] = { frame.Pixels(Framebuffer::Image), frame.Width(), frame.Height() };
+        StaleTiles(m_rect, false, slot);
+    }
+    m_images[slot].used = ++m_nDraws;
+    return slot;
+}
+
+// image is null for depth only, gray then receives the depth buffer as a gray scale
+void Render::RenderBitmaps(const Mesh& mesh, uint32_t* image, uint* gray)
+{
+    {
+        D3_PROFILE_SCOPE(m_profiler, Profile::Bin);
+        BinTriangles(mesh);
+    }
+
+    uint max = 0;
+    uint min = UINT_MAX;
+    switch(m_options.depth)
+    {
+    default:
+    case Options::Fixed32:
+        RenderTiles<Raster::DepthFixed>(image, min, max);
+        if(gray)
+            GrayScale<Raster::DepthFixed>(gray, min, max);
+        break;
+    case Options::Unorm16:
+        RenderTiles<Raster::DepthUnorm16>(image, min, max);
+        if(gray)
+            GrayScale<Raster::DepthUnorm16>(gray, min, max);
+        break;
+    case Options::Float32:
+        RenderTiles<Raster::DepthFloat>(image, min, max);
+        if(gray)
+            GrayScale<Raster::DepthFloat>(gray, min, max);
+        break;
+    }
+}
+
+template<class Format>
+void Render::RenderTiles(uint32_t* image, uint& min, uint& max)
+{
+    D3_PROFILE_SCOPE(m_profiler, Profile::Raster);
+    typename Format::Type* depth = (typename Format::Type*)m_depth.data();
+    const Raster::RowFunc<Format> row = (m_options.mode == Options::Overdraw) ? Raster::RowOverdraw<Format> : Raster::SelectRow<Format>();
+
+    // tiles own disjoint pixels and keep submission order, so any thread count renders the same image
+    std::atomic<uint> next(0);
+    auto job = [&](uint thread)
+    {
+        Counters counters = {};
+        counters.min = UINT_MAX;
+        for (uint tile; (tile = next++) < m_tiles.size(); )
+        {
+            // there is no full clear: a tile is cleared here, while it's about to be drawn
+            // into, and only of what an earlier frame drew; untouched tiles cost nothing
+            Tile& bin = m_tiles[tile];
+            ClearTile<Format>(bin, depth, image, counters);
+            for (uint i : bin.triangles)
+            {
+                const Triangle& triangle = m_triangles[i];
+                if(triangle.zMin >= bin.zMax)
+                    continue;   // behind everything already drawn in the tile
+                RasterizeTriangle<Format>(triangle, bin, row, depth, image, counters);
+            }
+            if(!bin.triangles.empty())
             {
-                len = sprintf(sz, "MPixels/S = %f", double(m_nPixels) / 1000 / delta);
-                TextOut(hdc, 0, offset, sz, len);
-                offset += 20;
+                bin.staleDepth = true;
+                bin.staleImage[m_slot] = bin.staleImage[m_slot] || image;
             }
-            len = sprintf(sz, "pov: x:%-2d y:%-2d z:%-2d r:%-2d", (int)eye.X(), (int)eye.Y(), (int)eye.Z(), (int)eye.W());
-            TextOut(hdc, 0, offset, sz, len);
-            offset += 20;
         }
-        else
+        m_counters[thread] = counters;
+    };
+    m_counters.resize(m_workers.Count());
+    m_workers.Run(job);
+
+    for (Counters& counters : m_counters)
+    {
+        if(min > counters.min) min = counters.min;
+        if(max < counters.max) max = counters.max;
+        m_nPixels += counters.pixels;
+        m_nWritten += counters.written;
+        m_nTexels  += counters.texels;
+        m_nCleared += counters.cleared;
+    }
+}
+
+// min & max are the depth keys drawn (reduced by the raster pass), nothing drawn is white;
+// a single streaming pass, bands of tile rows spread over the workers
+template<class Format>
+void Render::GrayScale(uint* gray, uint min, uint max)
+{
+    D3_PROFILE_SCOPE(m_profiler, Profile::Gray);
+    const typename Format::Type* depth = (const typename Format::Type*)m_depth.data();
+    const Raster::GrayFunc<Format> kernel = Raster::SelectGray<Format>();
+    const Raster::Gray toGray(min, max);
+    const uint width  = m_rect.Width();
+    const uint height = m_rect.Height();
+    const uint bands  = (height + TileSize - 1) / TileSize;
+
+    std::atomic<uint> next(0);
+    auto job = [&](uint)
+    {
+        for (uint band; (band = next++) < bands; )
         {
-            TextOutA(hdc, 0, 0, "Paused", 6);
+            uint y0 = band * TileSize;
+            uint y1 = std::min(y0 + TileSize, height);
+            kernel(depth + y0 * width, (y1 - y0) * width, gray + y0 * width, toGray);
         }
-    }
+    };
+    m_workers.Run(job);
 }
 
-void Render::Draw(HDC hdcScreen, Options& options, Point& eye)
+// the image holds visit counts after an Options::Overdraw raster pass, bands of tile rows over the workers
+void Render::HeatMap(uint32_t* image)
 {
-    GetClientRect(m_hWnd, &m_rect);
-    uint height = m_rect.Height();
-    uint width  = m_rect.Width();
-    uint size   = width * height;
+    D3_PROFILE_SCOPE(m_profiler, Profile::Heat);
+    const uint width  = m_rect.Width();
+    const uint height = m_rect.Height();
+    const uint bands  = (height + TileSize - 1) / TileSize;
 
-    if(m_options != options)
+    std::atomic<uint> next(0);
+    auto job = [&](uint)
+    {
+        for (uint band; (band = next++) < bands; )
+        {
+            uint y0 = band * TileSize;
+            uint y1 = std::min(y0 + TileSize, height);
+            Raster::HeatMap(image + y0 * width, (y1 - y0) * width);
+        }
+    };
+    m_workers.Run(job);
+}
+
+Stats Render::GetStats() const
+{
+    Stats stats = {};
+    stats.frames    = m_nFrames;
+    stats.seconds   = std::chrono::duration<double>(Clock::now() - m_start).count();
+    stats.pixels    = m_nPixels;
+    stats.written   = m_nWritten;
+    stats.texels    = m_nTexels;
+    stats.triangles = m_nTriangles;
+    stats.culled    = m_nCulled;
+    stats.rasterized = m_nRasterized;
+    stats.cleared   = m_nCleared;
+    stats.allocs    = m_nFrameAllocs;
+    return stats;
+}
+
+Framebuffer::Plane Render::Draw(Framebuffer& frame, const Options& options, const Point& eye)
+{
+    D3_PROFILE_FRAME(m_profiler);
+    D3_PROFILE_SCOPE(m_profiler, Profile::Draw);
+    uint64_t nAllocs = Simd::Allocations();
+    m_nFrameAllocs = nAllocs - m_nAllocs;
+    m_nAllocs = nAllocs;
+
+    Rect rect;
+    rect.right  = int(frame.Width());
+    rect.bottom = int(frame.Height());
+    uint32_t* image = frame.Pixels(Framebuffer::Image);
+    if((m_options != options) || (m_rect != rect))
     {
         m_nPixels = 0;
+        m_nWritten = 0;
+        m_nTexels = 0;
         m_nFrames = 0;
-        m_nStart  = GetTickCount();
+        m_start   = Clock::now();
 
+        if(m_options.depth != options.depth)
+            StaleTiles(m_rect, true, -1);       // holds the other format
         m_options = options;
-        if(m_options.pause) { ::KillTimer(m_hWnd, (UINT_PTR)this); }
-        else                { ::SetTimer(m_hWnd, (UINT_PTR)this, m_options.delay, TimerProc); }
+        m_workers.Resize(m_options.threads);
+        m_rect  = rect;
+        m_depth.resize(frame.Size());
     }
+    m_slot = AdoptImage(frame);
 
-    if((m_size != size) || !m_depth || !m_image)
+    // pipelined, a frame rasterizes the geometry the Draw() before posted while its own is
+    // built; the first frame after the options or the size changed waits for its own instead
+    if(!m_options.pipelined)
     {
-        m_nPixels = 0;
-        m_nFrames = 0;
-        m_nStart  = GetTickCount();
-
-        m_size    = size;
-        PUint depth(new uint[size]);
-        PQuad image(new RGBQUAD[size]);
-        m_depth = depth;
-        m_image = image;
-    }
-
-    PModel pModel = GetModel(m_options.model);
-    World  world  = CreateWorld(*pModel, m_angle, m_options.scale, m_options.offset);
-    Screen screen = ScreenTrasnform(world, m_rect, { eye.X(), eye.Y(), eye.Z() }, { 0, 0, 0 },
-                                    { (float)sin(eye.W() / 180 * pi), (float)cos(eye.W() / 180 * pi), 0 }, 45, 1, 100);
-    uint     max = 0;
-    uint     min = UINT_MAX;
-    HBITMAP  hBitmap = nullptr;
-    RGBQUAD* image = m_image.get();
-    uint*    depth = m_depth.get();
-    HDC      hdc = CreateCompatibleDC(nullptr);
-    bool     bDrawStats = true;
-    COLORREF rgbBG = RGB(255, 255, 255);
+        m_stage.Wait();     // the slots & GetModel() are this thread's again
+        m_pending = nullptr;
+    }
+    Geometry& next = m_geometry[m_nGeometry++ % Geometries];
+    next.options = m_options;
+    next.rect    = m_rect;
+    next.eye     = eye;
+    next.angle   = m_angle;
+    Geometry* geometry = &next;
+    if(m_options.pipelined)
+    {
+        uint64_t ticket = m_stage.Post(next);
+        if(m_pending && (m_pending->options == next.options) && (m_pending->rect == next.rect))
+        {
+            geometry = m_pending;
+            m_stage.Wait(m_pendingTicket);
+        }
+        else
+        {
+            m_stage.Wait(ticket);
+        }
+        m_pending = &next;
+        m_pendingTicket = ticket;
+    }
+    else
+    {
+        BuildGeometry(next);
+    }
+    for (int stage = 0; stage < Profile::Stages; stage++)
+    {
+        if(geometry->spans[stage][1])
+            m_profiler.Record(Profile::Stage(stage), geometry->spans[stage][0], geometry->spans[stage][1]);
+    }
+
+    Screen& screen = geometry->screen;
+    m_nCulled = geometry->culled;
+    m_nTriangles = uint(screen.Count());
+    m_nRasterized = 0;
+    m_nCleared = 0;
+    m_nFrames++;
 
     switch(m_options.mode)
     {
     default:
     case Options::Wireframe:
-        bDrawStats = false;
-        BitBlt(hdc, 0, 0, width, height, hdc, 0, 0, BLACKNESS);
-
-        hBitmap = CreateCompatibleBitmap(hdc, width, height);
-        SelectObject(hdc, hBitmap);
-
-        RenderWireFrame(screen, hdc);
-        break;
+    {
+        D3_PROFILE_SCOPE(m_profiler, Profile::Wire);
+        memset(image, 0x00, frame.Size() * sizeof(*image));
+        m_nCleared += frame.Size() * sizeof(*image);
+        StaleTiles(m_rect, false, m_slot);
+        RenderWireFrame(screen, image);
+        return Framebuffer::Image;
+    }
 
     case Options::DepthBuffer:
-        rgbBG = RGB(0, 0, 0);
-
-        memset(depth, 0xff, size * sizeof(*depth));
-        RenderBitmaps(screen, depth, nullptr, min, max);
-        GrayScale(depth, size, min, max);
-
-        hBitmap = CreateBitmap(width, height, 1, 32, depth);
-        break;
+        RenderBitmaps(screen, nullptr, frame.Pixels(Framebuffer::Depth));
+        return Framebuffer::Depth;
 
     case Options::Image:
-        memset(depth, 0xff, size * sizeof(*depth));
-        memset(image, 0x00, size * sizeof(*image));
-        RenderBitmaps(screen, depth, image, min, max);
+        RenderBitmaps(screen, image, nullptr);
+        return Framebuffer::Image;
 
-        hBitmap = CreateBitmap(width, height, 1, 32, image);
-        break;
+    case Options::Overdraw:
+        RenderBitmaps(screen, image, nullptr);
+        HeatMap(image);
+        return Framebuffer::Image;
     }
-    SelectObject(hdc, hBitmap);
-    DrawStats(hdc, rgbBG, eye, bDrawStats);
-    BitBlt(hdcScreen, 0, 0, width, height, hdc, 0, 0, SRCCOPY);
-    DeleteObject(hBitmap);
-    DeleteDC(hdc);
 }
@@ -1,8 +1,32 @@
 #pragma once
+#include <stdint.h>
 #include <memory>
 
+#include "D3.h"
+#include "Framebuffer.h"
+#include "Profile.h"
+
 using uint = uint32_t;
 
+/*/////////////////////////////////////////////////////////////////////
+//  IRender: the portable render core
+///////////////////////////////////////////////////////////////////////
+//
+//    draws the spinning models into a caller owned Framebuffer, no OS
+//    calls; the app (D3_app.cpp) is a Win32 front end around it that
+//    owns the window, the timers, the stats text & the presentation
+//
+//    IRender* render = IRender::Create(options);
+//    MemoryFramebuffer frame;
+//    frame.Resize(width, height);
+//    render->Timer();                  // one animation step
+//    auto plane = render->Draw(frame, options, eye);
+//    frame.Pixels(plane);              // the picture, 0x00RRGGBB
+//
+//    one thread at a time: RenderThread (RenderThread.h) runs it on its
+//    own thread, drawing into three framebuffers in rotation
+//*/
+
 struct Options
 {
     const char** surfaces = nullptr;
@@ -12,6 +36,7 @@ struct Options
         Wireframe,
         DepthBuffer,
         Image,
+        Overdraw,       // heat map of how often the rasterizer visited each pixel
     };
     enum Model
     {
@@ -22,7 +47,13 @@ struct Options
         Earth,
         Grid
     };
-    enum Delay
+    enum DepthFormat    // see Raster::DepthFixed
+    {
+        Fixed32,
+        Unorm16,
+        Float32,        // reversed Z
+    };
+    enum Delay          // of the front end's animation timer
     {
         slow    = 100,
         medium  = 50,
@@ -34,6 +65,14 @@ struct Options
     Delay   delay   = fast;
     Mode    mode    = Wireframe;
     Model   model   = Up;
+    uint    threads = 0;        // raster threads, 0 is one per core
+    bool    perspective = false;   // perspective correct texturing
+    bool    cull    = true;     // drop back faces & off screen triangles before rasterizing
+    bool    sort    = true;     // draw instances front to back
+    bool    tiled   = true;     // sample surfaces stored in 4x4 texel tiles
+    bool    mipmap  = true;     // sample the mip level matching each triangle's size
+    bool    pipelined = false;  // geometry of a frame overlaps the raster of the one before, see Draw()
+    DepthFormat depth = Fixed32;
     bool    track   = false;
     bool    stats   = false;
     bool    pause   = false;
@@ -46,19 +85,48 @@ struct Options
                 (delay == rhs.delay)  &&
                 (mode  == rhs.mode)   &&
                 (model == rhs.model)  &&
+                (threads == rhs.threads) &&
+                (perspective == rhs.perspective) &&
+                (cull  == rhs.cull)   &&
+                (sort  == rhs.sort)   &&
+                (tiled == rhs.tiled)  &&
+                (mipmap == rhs.mipmap) &&
+                (pipelined == rhs.pipelined) &&
+                (depth == rhs.depth)  &&
                 (track == rhs.track)  &&
                 (stats == rhs.stats)  &&
                 (pause == rhs.pause));
     }
 };
 
+struct Stats    // frames & pixels since the options or the frame last changed, the rest of the last frame
+{
+    uint        frames;
+    double      seconds;
+    uint64_t    pixels;     // covered, so depth tested
+    uint64_t    written;    // covered & passed the depth test
+    uint64_t    texels;     // fetched, one per written pixel the surface covers
+    uint        triangles;  // submitted after culling, culled + triangles were transformed
+    uint        culled;
+    uint        rasterized; // of triangles, the ones set up & binned: on screen & not degenerate
+    uint64_t    cleared;    // bytes
+    uint64_t    allocs;     // heap allocations since the frame before, see Simd::Allocations()
+};
+
 class IRender
 {
 public:
-    static IRender* Create(HWND hWnd);
+    static IRender* Create(const Options& options);  // loads options.surfaces
 
     virtual ~IRender() {}
 
     virtual void Timer() = 0;
-    virtual void Draw(HDC hdcScreen, Options& options, D3::Point& eye) = 0;
+    // draws at the frame's size, returns the plane holding the picture; with options.pipelined
+    // it's the picture of the eye & animation step of the call before (at most 2 frames in flight)
+    virtual Framebuffer::Plane Draw(Framebuffer& frame, const Options& options, const D3::Point& eye) = 0;
+    // the caller drew over rect of the frame's image plane, it's cleared before being drawn into again
+    virtual void Overdrawn(Framebuffer& frame, const D3::Rect& rect) = 0;
+    virtual Stats GetStats() const = 0;
+    // Draw() records its stages here, the front end adds Profile::Present
+    virtual D3::Profile::Profiler& Profiler() = 0;
 };
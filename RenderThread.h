@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "Render.h"
+
+/*/////////////////////////////////////////////////////////////////////
+//  RenderThread: draws on its own thread, the UI thread only presents
+///////////////////////////////////////////////////////////////////////
+//
+//    three framebuffers rotate: one being drawn, the newest finished
+//    and the one the UI is presenting, so neither thread waits for the
+//    other; the UI hands in snapshots of the options & eye, the latest
+//    wins, and the render thread draws whenever one changed or the
+//    animation stepped
+//
+//    RenderThread thread(*render, frames, [] { ... });   // called after each frame
+//    thread.Submit(options, eye, width, height);
+//    thread.Step();                                // one animation step, see IRender::Timer()
+//    if(const RenderThread::Frame* frame = thread.Acquire())  // held until the next Acquire()
+//        ... present frame->frame, then
+//    thread.Presented(text, start, end);           // the rect drawn over it & the time it took
+//    thread.Exclusive([&] { render->...; });       // with the render thread idle
+//
+//    the IRender belongs to the render thread while it runs, only
+//    Exclusive() may call it from elsewhere
+//
+//    a pipelined frame (Options::pipelined) shows the inputs of the draw
+//    before, so once idle the thread draws once more to catch up
+//*/
+
+class RenderThread
+{
+public:
+    static const int Buffers = 3;
+
+    struct Frame        // a finished frame and what it was drawn from
+    {
+        Framebuffer*        frame = nullptr;
+        Framebuffer::Plane  plane = Framebuffer::Image;
+        Options             options;
+        D3::Point           eye   = { 0, 0, 0, 0 };
+        Stats               stats = {};
+        double              ms[D3::Profile::Stages][3] = {};    // stage percentiles, with options.stats only
+    };
+
+private:
+    IRender&                _render;
+    std::function<void()>   _finished;
+    Frame                   _frames[Buffers];
+    D3::Rect                _overdrawn[Buffers];    // by the UI, passed on before the next draw into it
+    int                     _ready     = -1;        // newest finished, not yet acquired
+    int                     _presented = -1;        // held by the UI
+
+    Options                 _options;               // the latest snapshot
+    D3::Point               _eye    = { 0, 0, 0, 0 };
+    uint32_t                _width  = 0;
+    uint32_t                _height = 0;
+    uint                    _steps  = 0;            // Timer() calls to make before the next draw
+    int64_t                 _presentStart = 0;      // the UI's last present, on the profiler's clock
+    int64_t                 _presentEnd   = 0;
+    bool                    _dirty  = false;
+    bool                    _exit   = false;
+
+    std::mutex              _mutex;                 // guards the members above
+    std::mutex              _drawing;               // held while the render thread uses _render
+    std::condition_variable _wake;
+    std::thread             _thread;
+
+    static const int Settle = 30;   // ms idle before catching up, see Main()
+
+    void Main()
+    {
+        bool behind = false;    // the last frame was pipelined, so of the inputs of the one before
+        for (;;)
+        {
+            bool        catchUp = false;
+            int         buffer = 0;
+            Options     options;
+            D3::Point   eye;
+            uint32_t    width, height;
+            uint        steps;
+            D3::Rect    overdrawn;
+            int64_t     presentStart, presentEnd;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto pending = [&] { return _exit || _dirty || _steps; };
+                if(!behind)
+                    _wake.wait(lock, pending);
+                else if(!_wake.wait_for(lock, std::chrono::milliseconds(Settle), pending))
+                    catchUp = true;     // idle: the same inputs again show the latest
+                if(_exit)
+                    return;
+                while ((buffer == _ready) || (buffer == _presented))
+                    buffer++;
+                options = _options;
+                eye     = _eye;
+                width   = _width;
+                height  = _height;
+                steps   = _steps;
+                overdrawn = _overdrawn[buffer];
+                presentStart = _presentStart;
+                presentEnd   = _presentEnd;
+                _overdrawn[buffer] = {};
+                _presentEnd = 0;
+                _steps = 0;
+                _dirty = false;
+            }
+
+            Frame& frame = _frames[buffer];
+            {
+                std::lock_guard<std::mutex> lock(_drawing);
+                if(presentEnd)
+                    _render.Profiler().Record(D3::Profile::Present, presentStart, presentEnd);
+                if((overdrawn.Width() > 0) && (overdrawn.Height() > 0))
+                    _render.Overdrawn(*frame.frame, overdrawn);
+                for (uint i = 0; i < steps; i++)
+                {
+                    _render.Timer();
+                }
+                frame.frame->Resize(width, height);
+                frame.plane   = _render.Draw(*frame.frame, options, eye);
+                behind = options.pipelined && !catchUp;
+                frame.options = options;
+                frame.eye     = eye;
+                frame.stats   = _render.GetStats();
+                for (int stage = 0; options.stats && (stage < D3::Profile::Stages); stage++)
+                {
+                    _render.Profiler().Percentiles(D3::Profile::Stage(stage), frame.ms[stage]);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _ready = buffer;
+            }
+            if(_finished)
+                _finished();
+        }
+    }
+
+public:
+    // frames are the Buffers framebuffers to rotate, finished is called on the render thread
+    RenderThread(IRender& render, Framebuffer* frames[Buffers], std::function<void()> finished)
+        : _render(render), _finished(finished)
+    {
+        for (int i = 0; i < Buffers; i++)
+        {
+            _frames[i].frame = frames[i];
+        }
+        _thread = std::thread(&RenderThread::Main, this);
+    }
+
+    ~RenderThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _exit = true;
+        }
+        _wake.notify_one();
+        _thread.join();
+    }
+
+    // the latest options, eye & size to draw with, a frame is drawn when they changed
+    void Submit(const Options& options, const D3::Point& eye, uint32_t width, uint32_t height)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if((_options == options) && (_eye == eye) && (_width == width) && (_height == height))
+                return;
+            _options = options;
+            _eye     = eye;
+            _width   = width;
+            _height  = height;
+            _dirty   = true;
+        }
+        _wake.notify_one();
+    }
+
+    void Step()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _steps++;
+        }
+        _wake.notify_one();
+    }
+
+    // the newest finished frame, or the one held when none finished since; null before the first
+    const Frame* Acquire()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_ready >= 0)
+        {
+            _presented = _ready;
+            _ready = -1;
+        }
+        return (_presented >= 0) ? &_frames[_presented] : nullptr;
+    }
+
+    // the UI drew over rect of the held frame's image plane, presenting took start..end (IRender::Profiler() clock)
+    void Presented(const D3::Rect& rect, int64_t start, int64_t end)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_presented < 0)
+            return;
+        D3::Rect& overdrawn = _overdrawn[_presented];
+        if((overdrawn.Width() > 0) && (overdrawn.Height() > 0))
+        {
+            overdrawn.left   = std::min(overdrawn.left, rect.left);
+            overdrawn.top    = std::min(overdrawn.top, rect.top);
+            overdrawn.right  = std::max(overdrawn.right, rect.right);
+            overdrawn.bottom = std::max(overdrawn.bottom, rect.bottom);
+        }
+        else
+        {
+            overdrawn = rect;
+        }
+        _presentStart = start;
+        _presentEnd   = end;
+    }
+
+    // runs f while the render thread isn't drawing, f may use the IRender
+    template<typename F>
+    void Exclusive(F f)
+    {
+        std::lock_guard<std::mutex> lock(_drawing);
+        f();
+    }
+};
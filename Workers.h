@@ -0,0 +1,185 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using uint = uint32_t;
+
+// persistent thread pool: Run() executes one job on every thread (the caller is thread 0)
+// and returns once all of them have finished; it never allocates after Resize()
+class Workers
+{
+    using Call = void (*)(void* job, uint thread);
+
+    std::vector<std::thread>    _threads;
+    std::mutex                  _mutex;
+    std::condition_variable     _start;
+    std::condition_variable     _done;
+    Call                        _call = nullptr;
+    void*                       _job = nullptr;
+    uint64_t                    _generation = 0;
+    uint                        _busy = 0;
+    bool                        _exit = false;
+
+    void Main(uint thread, uint64_t generation)
+    {
+        for (;;)
+        {
+            Call  call = nullptr;
+            void* job = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _start.wait(lock, [&] { return _exit || (_generation != generation); });
+                if(_exit)
+                    return;
+                generation = _generation;
+                call = _call;
+                job = _job;
+            }
+            call(job, thread);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(--_busy == 0)
+                    _done.notify_one();
+            }
+        }
+    }
+
+public:
+    Workers() {}
+    ~Workers() { Resize(1); }
+
+    uint Count() const { return uint(_threads.size()) + 1; }
+
+    // count includes the calling thread, 0 is one thread per core
+    void Resize(uint count)
+    {
+        if(!count)
+            count = std::max(1u, std::thread::hardware_concurrency());
+        if(count == Count())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _exit = true;
+        }
+        _start.notify_all();
+        for (auto& thread : _threads)
+        {
+            thread.join();
+        }
+        _threads.clear();
+        _exit = false;
+
+        for (uint i = 1; i < count; i++)
+        {
+            _threads.emplace_back(&Workers::Main, this, i, _generation);
+        }
+    }
+
+    // job(uint thread) runs on Count() threads at once
+    template<typename Job>
+    void Run(Job& job)
+    {
+        if(_threads.empty())
+        {
+            job(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _call = [](void* job, uint thread) { (*(Job*)job)(thread); };
+            _job = &job;
+            _busy = uint(_threads.size());
+            _generation++;
+        }
+        _start.notify_all();
+
+        job(0);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [&] { return _busy == 0; });
+    }
+};
+
+// one pipeline stage: a thread running the jobs Post()ed to it in order, at most Depth queued;
+// Post() blocks while the queue is full and returns a ticket for Wait(), nothing allocates
+template<uint Depth>
+class StageQueue
+{
+    using Call = void (*)(void* job);
+
+    std::mutex                  _mutex;
+    std::condition_variable     _posted;
+    std::condition_variable     _ran;
+    Call                        _calls[Depth] = {};
+    void*                       _jobs[Depth] = {};
+    uint64_t                    _head = 0;      // jobs posted
+    uint64_t                    _tail = 0;      // jobs run
+    bool                        _exit = false;
+    std::thread                 _thread;        // last, it starts with the members above ready
+
+    void Main()
+    {
+        for (;;)
+        {
+            Call  call = nullptr;
+            void* job = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _posted.wait(lock, [&] { return _exit || (_tail != _head); });
+                if(_tail == _head)
+                    return;
+                call = _calls[_tail % Depth];
+                job = _jobs[_tail % Depth];
+            }
+            call(job);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _tail++;
+            }
+            _ran.notify_all();
+        }
+    }
+
+public:
+    StageQueue() : _thread(&StageQueue::Main, this) {}
+    ~StageQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _exit = true;
+        }
+        _posted.notify_one();
+        _thread.join();     // after the jobs still queued
+    }
+
+    // job() runs on the stage's thread, job must live until Wait(ticket) returns
+    template<typename Job>
+    uint64_t Post(Job& job)
+    {
+        uint64_t ticket;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _ran.wait(lock, [&] { return _head - _tail < Depth; });
+            _calls[_head % Depth] = [](void* job) { (*(Job*)job)(); };
+            _jobs[_head % Depth] = &job;
+            ticket = ++_head;
+        }
+        _posted.notify_one();
+        return ticket;
+    }
+
+    // until the job of ticket ran, 0 waits for every job posted
+    void Wait(uint64_t ticket = 0)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(!ticket)
+            ticket = _head;
+        _ran.wait(lock, [&] { return _tail >= ticket; });
+    }
+};